@@ -0,0 +1,76 @@
+#ifndef _BACKEND_H
+#define _BACKEND_H 1
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* =============================== TYPES =============================== */
+
+/** A short MIDI message as it enters or leaves the system */
+typedef struct midi_msg_s {
+    uint32_t         message; /**< Status | data1 << 8 | data2 << 16 */
+    uint8_t          prio; /**< Output priority, see shaper.h */
+    uint8_t          source; /**< Input: index of the port it came from */
+    uint64_t         when; /**< getclock() time, 0 for immediate */
+    uint64_t         stamp; /**< Time the output was handed to the writer */
+    uint64_t         cause; /**< Read time of the input that caused the
+                                 output, 0 if none */
+} midi_msg;
+
+/** Information about a MIDI port, as enumerated by a backend */
+typedef struct midi_devinfo_s {
+    char             name[256]; /**< Port name */
+    bool             input; /**< True if we can receive from the port */
+    bool             output; /**< True if we can send to the port */
+    bool             system; /**< True for system and through ports */
+} midi_devinfo;
+
+/** Backend-specific representation of an open port */
+typedef struct midi_port_s midi_port;
+
+/** Operations implemented by a MIDI backend */
+typedef struct midi_backend_s {
+    const char  *name; /**< Name used in the configuration */
+
+    /** Returns true if the backend can be used at all */
+    bool       (*init) (void);
+
+    /** Returns true if there is a physical port to talk to */
+    bool       (*available) (void);
+
+    /** Re-enumerates devices, returns the number found */
+    int        (*count_devices) (void);
+
+    /** Gets information about an enumerated device */
+    bool       (*get_device) (int devid, midi_devinfo *into);
+
+    /** Opens an enumerated device for input */
+    midi_port *(*open_input) (int devid);
+
+    /** Opens an enumerated device for output. With a non-zero latency
+        (in ms), messages are delivered at their timestamp. */
+    midi_port *(*open_output) (int devid, int latency);
+
+    /** Closes an open port */
+    void       (*close) (midi_port *);
+
+    /** Waits for input data on any of a set of ports. Returns >0 if
+        there is data, 0 on timeout, <0 on error */
+    int        (*wait) (midi_port **, int nports, int timeout_ms);
+
+    /** Reads pending input from a set of ports, returns the number of
+        messages read. Sets the source of every message to the index
+        of its port in the set. */
+    int        (*read) (midi_port **, int nports, midi_msg *, int count);
+
+    /** Writes a batch of messages, returns false on error */
+    bool       (*write) (midi_port *, const midi_msg *, int count);
+} midi_backend;
+
+/* ============================== GLOBALS ============================== */
+
+extern midi_backend MIDI_ALSA;
+extern midi_backend MIDI_PORTMIDI;
+extern midi_backend MIDI_SIM;
+
+#endif
@@ -0,0 +1,305 @@
+#include "backend.h"
+#include "thread.h"
+
+#include <alsa/asoundlib.h>
+#include <stdlib.h>
+#include <string.h>
+#include <poll.h>
+
+/** Maximum number of sequencer ports we keep track of */
+#define ALSA_MAXDEV 64
+
+/** An open sequencer port on the other side of a connection */
+struct midi_port_s {
+    int              client; /**< Remote client id */
+    int              port; /**< Remote port id */
+    bool             output; /**< True if we send to this port */
+    int              latency; /**< Output latency in ms, 0 for direct */
+};
+
+/** A port found during enumeration */
+typedef struct alsa_device_s {
+    int              client; /**< Client id */
+    int              port; /**< Port id */
+    midi_devinfo     info; /**< Public information */
+} alsa_device;
+
+/** State of the ALSA sequencer backend */
+static struct alsastate {
+    bool             open; /**< True if the clients are set up */
+    snd_seq_t       *seq_in; /**< Input client, read by the receive thread */
+    snd_seq_t       *seq_out; /**< Output client, owns the queue */
+    int              in_port; /**< Our input port */
+    int              out_port; /**< Our output port */
+    int              queue; /**< Queue for timestamped output */
+    uint64_t         qstart; /**< getclock() time of queue time zero */
+    snd_midi_event_t *encoder; /**< Bytes to sequencer events */
+    snd_midi_event_t *decoder; /**< Sequencer events to bytes */
+    int              devcount; /**< Number of enumerated devices */
+    alsa_device      dev[ALSA_MAXDEV]; /**< Enumerated devices */
+} self;
+
+/** Open the sequencer clients, create our ports and start the output
+  * queue. Returns false if there is no ALSA sequencer.
+  */
+static bool alsa_init (void) {
+    if (self.open) return true;
+    if (snd_seq_open (&self.seq_out, "default", SND_SEQ_OPEN_OUTPUT, 0) < 0) {
+        return false;
+    }
+    if (snd_seq_open (&self.seq_in, "default", SND_SEQ_OPEN_INPUT, 0) < 0) {
+        snd_seq_close (self.seq_out);
+        return false;
+    }
+    snd_seq_nonblock (self.seq_in, 1);
+    snd_seq_set_client_name (self.seq_in, "triggermagic in");
+    snd_seq_set_client_name (self.seq_out, "triggermagic out");
+
+    self.in_port = snd_seq_create_simple_port (self.seq_in, "in",
+                        SND_SEQ_PORT_CAP_WRITE | SND_SEQ_PORT_CAP_SUBS_WRITE,
+                        SND_SEQ_PORT_TYPE_MIDI_GENERIC |
+                        SND_SEQ_PORT_TYPE_APPLICATION);
+    self.out_port = snd_seq_create_simple_port (self.seq_out, "out",
+                        SND_SEQ_PORT_CAP_READ | SND_SEQ_PORT_CAP_SUBS_READ,
+                        SND_SEQ_PORT_TYPE_MIDI_GENERIC |
+                        SND_SEQ_PORT_TYPE_APPLICATION);
+    self.queue = snd_seq_alloc_named_queue (self.seq_out, "triggermagic");
+    if (self.in_port < 0 || self.out_port < 0 || self.queue < 0) {
+        snd_seq_close (self.seq_in);
+        snd_seq_close (self.seq_out);
+        return false;
+    }
+
+    snd_midi_event_new (16, &self.encoder);
+    snd_midi_event_new (16, &self.decoder);
+    snd_midi_event_no_status (self.decoder, 1);
+
+    /* Realtime queue time zero lines up with our clock at this point */
+    snd_seq_start_queue (self.seq_out, self.queue, NULL);
+    snd_seq_drain_output (self.seq_out);
+    self.qstart = getclock();
+    self.devcount = 0;
+    self.open = true;
+    return true;
+}
+
+/** Walk the sequencer clients and collect their MIDI ports */
+static int alsa_count_devices (void) {
+    snd_seq_client_info_t *cinfo;
+    snd_seq_port_info_t *pinfo;
+    if (! alsa_init()) return 0;
+
+    int own_in = snd_seq_client_id (self.seq_in);
+    int own_out = snd_seq_client_id (self.seq_out);
+
+    snd_seq_client_info_alloca (&cinfo);
+    snd_seq_port_info_alloca (&pinfo);
+    snd_seq_client_info_set_client (cinfo, -1);
+    self.devcount = 0;
+
+    while (snd_seq_query_next_client (self.seq_out, cinfo) >= 0) {
+        int client = snd_seq_client_info_get_client (cinfo);
+        if (client == SND_SEQ_CLIENT_SYSTEM) continue;
+        if (client == own_in || client == own_out) continue;
+        const char *cname = snd_seq_client_info_get_name (cinfo);
+        bool through = (strncmp (cname, "Midi Through", 12) == 0);
+
+        snd_seq_port_info_set_client (pinfo, client);
+        snd_seq_port_info_set_port (pinfo, -1);
+        while (snd_seq_query_next_port (self.seq_out, pinfo) >= 0) {
+            if (self.devcount >= ALSA_MAXDEV) return self.devcount;
+            unsigned int cap = snd_seq_port_info_get_capability (pinfo);
+            if (cap & SND_SEQ_PORT_CAP_NO_EXPORT) continue;
+            if (! (snd_seq_port_info_get_type (pinfo) &
+                   SND_SEQ_PORT_TYPE_MIDI_GENERIC)) continue;
+
+            alsa_device *d = self.dev + self.devcount;
+            d->client = client;
+            d->port = snd_seq_port_info_get_port (pinfo);
+            strncpy (d->info.name, snd_seq_port_info_get_name (pinfo), 255);
+            d->info.name[255] = 0;
+            d->info.input = ((cap & SND_SEQ_PORT_CAP_READ) &&
+                             (cap & SND_SEQ_PORT_CAP_SUBS_READ));
+            d->info.output = ((cap & SND_SEQ_PORT_CAP_WRITE) &&
+                              (cap & SND_SEQ_PORT_CAP_SUBS_WRITE));
+            d->info.system = through;
+            if (d->info.input || d->info.output) self.devcount++;
+        }
+    }
+    return self.devcount;
+}
+
+/** Returns true if there is a port we can both send to and receive
+  * from, other than the through ports.
+  */
+static bool alsa_available (void) {
+    int count = alsa_count_devices();
+    for (int i=0; i<count; ++i) {
+        midi_devinfo *d = &self.dev[i].info;
+        if (d->input && d->output && ! d->system) return true;
+    }
+    return false;
+}
+
+/** Get information about an enumerated port */
+static bool alsa_get_device (int devid, midi_devinfo *into) {
+    if (devid < 0 || devid >= self.devcount) return false;
+    memcpy (into, &self.dev[devid].info, sizeof (midi_devinfo));
+    return true;
+}
+
+/** Subscribe our input port to an enumerated port */
+static midi_port *alsa_open_input (int devid) {
+    if (devid < 0 || devid >= self.devcount) return NULL;
+    alsa_device *d = self.dev + devid;
+    if (snd_seq_connect_from (self.seq_in, self.in_port,
+                              d->client, d->port) < 0) return NULL;
+
+    midi_port *res = (midi_port *) malloc (sizeof (midi_port));
+    res->client = d->client;
+    res->port = d->port;
+    res->output = false;
+    res->latency = 0;
+    return res;
+}
+
+/** Set up output to an enumerated port. Events are addressed to the
+  * port directly, so no subscription is needed.
+  */
+static midi_port *alsa_open_output (int devid, int latency) {
+    if (devid < 0 || devid >= self.devcount) return NULL;
+    alsa_device *d = self.dev + devid;
+    midi_port *res = (midi_port *) malloc (sizeof (midi_port));
+    res->client = d->client;
+    res->port = d->port;
+    res->output = true;
+    res->latency = latency;
+    return res;
+}
+
+/** Close a port */
+static void alsa_close (midi_port *p) {
+    if (! p->output) {
+        snd_seq_disconnect_from (self.seq_in, self.in_port,
+                                 p->client, p->port);
+    }
+    free (p);
+}
+
+/** Block on the sequencer file descriptors until input arrives. All
+  * inputs are subscribed to our one input port, so that's a single
+  * wait for all of them.
+  */
+static int alsa_wait (midi_port **ports, int nports, int timeout_ms) {
+    struct pollfd pfd[4];
+    if (snd_seq_event_input_pending (self.seq_in, 0) > 0) return 1;
+    int n = snd_seq_poll_descriptors (self.seq_in, pfd, 4, POLLIN);
+    return poll (pfd, n, timeout_ms);
+}
+
+/** Read pending input events, and turn them back into short messages.
+  * Events come in the order they arrived, whatever port they came
+  * from, and are told apart by their source address.
+  */
+static int alsa_read (midi_port **ports, int nports, midi_msg *into,
+                      int count) {
+    snd_seq_event_t *ev;
+    unsigned char buf[16];
+    int res = 0;
+
+    while (res < count) {
+        int r = snd_seq_event_input (self.seq_in, &ev);
+        if (r == -ENOSPC) continue; /* overrun, keep reading */
+        if (r < 0) break;
+
+        int src = 0;
+        while (src < nports && (ports[src]->client != ev->source.client ||
+                                ports[src]->port != ev->source.port)) src++;
+        if (src == nports) continue; /* not one of ours */
+
+        snd_midi_event_reset_decode (self.decoder);
+        long len = snd_midi_event_decode (self.decoder, buf, 16, ev);
+        if (len < 1 || len > 3) continue; /* no sysex */
+        if (buf[0] == 0xfe) continue; /* no active sensing */
+
+        uint32_t msg = buf[0];
+        if (len > 1) msg |= ((uint32_t) buf[1]) << 8;
+        if (len > 2) msg |= ((uint32_t) buf[2]) << 16;
+        into[res].message = msg;
+        into[res].source = src;
+        into[res].when = getclock();
+        res++;
+    }
+    return res;
+}
+
+/** Returns the number of bytes in a short message with this status */
+static int alsa_msglen (uint8_t status) {
+    if (status < 0xc0) return 3;
+    if (status < 0xe0) return 2;
+    if (status < 0xf0) return 3;
+    if (status == 0xf2) return 3;
+    if (status == 0xf1 || status == 0xf3) return 2;
+    return 1;
+}
+
+/** Send a batch of messages. With a latency configured, messages that
+  * are due in the future are scheduled on the realtime queue, so the
+  * kernel handles their exact timing. All ports share one output
+  * buffer, so whatever is left in it after a failure is dropped, or it
+  * would make the writes to every other port fail as well.
+  */
+static bool alsa_write (midi_port *p, const midi_msg *msgs, int count) {
+    snd_seq_event_t ev;
+    unsigned char buf[3];
+    uint64_t now = getclock();
+
+    for (int i=0; i<count; ++i) {
+        uint32_t msg = msgs[i].message;
+        buf[0] = msg & 0xff;
+        buf[1] = (msg >> 8) & 0x7f;
+        buf[2] = (msg >> 16) & 0x7f;
+
+        snd_seq_ev_clear (&ev);
+        snd_midi_event_reset_encode (self.encoder);
+        snd_midi_event_encode (self.encoder, buf, alsa_msglen (buf[0]), &ev);
+        if (ev.type == SND_SEQ_EVENT_NONE) continue;
+
+        snd_seq_ev_set_source (&ev, self.out_port);
+        snd_seq_ev_set_dest (&ev, p->client, p->port);
+        if (p->latency && msgs[i].when > now) {
+            uint64_t ns = msgs[i].when - self.qstart;
+            snd_seq_real_time_t rt = {
+                .tv_sec = (unsigned int) (ns / CLOCK_SEC),
+                .tv_nsec = (unsigned int) (ns % CLOCK_SEC)
+            };
+            snd_seq_ev_schedule_real (&ev, self.queue, 0, &rt);
+        }
+        else snd_seq_ev_set_direct (&ev);
+
+        if (snd_seq_event_output (self.seq_out, &ev) < 0) {
+            snd_seq_drop_output (self.seq_out);
+            return false;
+        }
+    }
+    if (snd_seq_drain_output (self.seq_out) < 0) {
+        snd_seq_drop_output (self.seq_out);
+        return false;
+    }
+    return true;
+}
+
+/** The ALSA sequencer backend */
+midi_backend MIDI_ALSA = {
+    .name = "alsa",
+    .init = alsa_init,
+    .available = alsa_available,
+    .count_devices = alsa_count_devices,
+    .get_device = alsa_get_device,
+    .open_input = alsa_open_input,
+    .open_output = alsa_open_output,
+    .close = alsa_close,
+    .wait = alsa_wait,
+    .read = alsa_read,
+    .write = alsa_write
+};
@@ -0,0 +1,160 @@
+#include "backend.h"
+#include "thread.h"
+
+#include <portmidi.h>
+#include <stdlib.h>
+#include <string.h>
+
+/** An open PortMidi stream */
+struct midi_port_s {
+    PortMidiStream  *stream; /**< The PortMidi stream */
+    int              latency; /**< Output latency in ms */
+};
+
+/** PortMidi time source, in milliseconds on the getclock() timebase */
+static PmTimestamp pm_timeproc (void *info) {
+    return (PmTimestamp) (getclock() / CLOCK_MSEC);
+}
+
+/** PortMidi needs no setup of its own */
+static bool pm_init (void) {
+    return true;
+}
+
+/** Poll ALSA for an available MIDI port. Don't use portmidi yet, or it
+  * will be bound to the non-working situation.
+  */
+static bool pm_available (void) {
+    if (system ("/usr/bin/amidi -l | grep -q ^IO")) return false;
+    return true;
+}
+
+/** Count PortMidi devices */
+static int pm_count_devices (void) {
+    return Pm_CountDevices();
+}
+
+/** Get PortMidi device information. The first two devices are the
+  * ALSA through ports.
+  */
+static bool pm_get_device (int devid, midi_devinfo *into) {
+    const PmDeviceInfo *d = Pm_GetDeviceInfo (devid);
+    if (! d) return false;
+    strncpy (into->name, d->name, 255);
+    into->name[255] = 0;
+    into->input = d->input ? true : false;
+    into->output = d->output ? true : false;
+    into->system = (devid < 2);
+    return true;
+}
+
+/** Open a device for input */
+static midi_port *pm_open_input (int devid) {
+    midi_port *res = (midi_port *) malloc (sizeof (midi_port));
+    res->latency = 0;
+    if (Pm_OpenInput (&res->stream, devid, NULL, 128,
+                      pm_timeproc, NULL) != pmNoError) {
+        free (res);
+        return NULL;
+    }
+    Pm_SetFilter (res->stream, PM_FILT_ACTIVE | PM_FILT_SYSEX);
+    return res;
+}
+
+/** Open a device for output. A non-zero latency makes PortMidi honor
+  * message timestamps.
+  */
+static midi_port *pm_open_output (int devid, int latency) {
+    midi_port *res = (midi_port *) malloc (sizeof (midi_port));
+    res->latency = latency;
+    if (Pm_OpenOutput (&res->stream, devid, NULL, 128, pm_timeproc,
+                       NULL, latency) != pmNoError) {
+        free (res);
+        return NULL;
+    }
+    return res;
+}
+
+/** Close a port */
+static void pm_close (midi_port *p) {
+    Pm_Close (p->stream);
+    free (p);
+}
+
+/** PortMidi can't block on input, so poll all ports for it every
+  * millisecond */
+static int pm_wait (midi_port **ports, int nports, int timeout_ms) {
+    for (int i=0; i<timeout_ms; ++i) {
+        for (int p=0; p<nports; ++p) {
+            if (Pm_Poll (ports[p]->stream) == TRUE) return 1;
+        }
+        musleep (1000);
+    }
+    return 0;
+}
+
+/** Read pending input from all ports. PortMidi stamps input with its
+  * time source when it arrives, which keeps the order between ports
+  * down to the millisecond.
+  */
+static int pm_read (midi_port **ports, int nports, midi_msg *into,
+                    int count) {
+    PmEvent buffer[128];
+    uint64_t now = getclock();
+    int total = 0;
+    for (int p=0; p<nports && total<count; ++p) {
+        int want = count - total;
+        if (want > 128) want = 128;
+        int res = Pm_Read (ports[p]->stream, buffer, want);
+        if (res < 0) continue;
+        for (int i=0; i<res; ++i) {
+            uint64_t when = (uint64_t) buffer[i].timestamp * CLOCK_MSEC;
+            midi_msg *m = into + total + i;
+            m->message = buffer[i].message;
+            m->source = p;
+            m->when = (when && when < now) ? when : now;
+        }
+        total += res;
+    }
+    return total;
+}
+
+/** Write a batch of messages. PortMidi delivers at timestamp+latency,
+  * so timestamps are pulled back by the latency. Immediate output is
+  * stamped a full latency in the past.
+  */
+static bool pm_write (midi_port *p, const midi_msg *msgs, int count) {
+    PmEvent buffer[128];
+    uint64_t now = getclock();
+    while (count > 0) {
+        int batch = (count > 128) ? 128 : count;
+        for (int i=0; i<batch; ++i) {
+            uint64_t when = msgs[i].when ? msgs[i].when : now;
+            buffer[i].message = (PmMessage) msgs[i].message;
+            buffer[i].timestamp = 0;
+            if (p->latency) {
+                buffer[i].timestamp = (PmTimestamp) (when/CLOCK_MSEC) -
+                                      p->latency;
+            }
+        }
+        if (Pm_Write (p->stream, buffer, batch) != pmNoError) return false;
+        msgs += batch;
+        count -= batch;
+    }
+    return true;
+}
+
+/** The PortMidi backend */
+midi_backend MIDI_PORTMIDI = {
+    .name = "portmidi",
+    .init = pm_init,
+    .available = pm_available,
+    .count_devices = pm_count_devices,
+    .get_device = pm_get_device,
+    .open_input = pm_open_input,
+    .open_output = pm_open_output,
+    .close = pm_close,
+    .wait = pm_wait,
+    .read = pm_read,
+    .write = pm_write
+};
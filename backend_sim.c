@@ -0,0 +1,184 @@
+#include "backend.h"
+#include "thread.h"
+#include "sim.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/** Number of input messages that can be queued up */
+#define SIM_QUEUE 256
+
+/** Number of simulated devices, all of them do input and output */
+#define SIM_DEVICES 4
+
+/** An open simulated port */
+struct midi_port_s {
+    int              devid; /**< Device the port is on */
+    int              latency; /**< Output latency in ms */
+};
+
+/** A queued input message */
+typedef struct siminput_s {
+    uint32_t         message; /**< The message */
+    int              devid; /**< Device it comes in on */
+} siminput;
+
+/** Simulated device state */
+static struct simstate {
+    siminput         queue[SIM_QUEUE]; /**< Injected input */
+    int              count; /**< Number of queued input messages */
+    FILE            *out; /**< Where output gets logged, NULL for nowhere */
+    uint64_t         epoch; /**< Time logged as 0 */
+    uint64_t         written; /**< Number of messages written */
+} SIM = { {{0}}, 0, NULL, 0, 0 };
+
+/** Set up the simulated device.
+  * \param out Where to log output, NULL to drop it, as benchmarks do.
+  * \param epoch The getclock() time to log as 0.
+  */
+void sim_setup (FILE *out, uint64_t epoch) {
+    SIM.out = out;
+    SIM.epoch = epoch;
+    SIM.count = 0;
+}
+
+/** Returns the number of messages written since the start */
+uint64_t sim_output_count (void) {
+    return SIM.written;
+}
+
+/** Queue a message as input, to be read at the next read.
+  * \param devid The device it comes in on.
+  * \param message The message.
+  * \return false if the queue is full.
+  */
+bool sim_push_input (int devid, uint32_t message) {
+    if (SIM.count >= SIM_QUEUE) return false;
+    SIM.queue[SIM.count].message = message;
+    SIM.queue[SIM.count].devid = devid;
+    SIM.count++;
+    return true;
+}
+
+/** Nothing to set up */
+static bool sim_init (void) {
+    return true;
+}
+
+/** The simulated device is always there */
+static bool sim_available (void) {
+    return true;
+}
+
+/** Returns the number of devices */
+static int sim_count_devices (void) {
+    return SIM_DEVICES;
+}
+
+/** The devices are called "sim", "sim 2" and so on */
+static bool sim_get_device (int devid, midi_devinfo *into) {
+    if (devid < 0 || devid >= SIM_DEVICES) return false;
+    if (devid) sprintf (into->name, "sim %i", devid+1);
+    else strcpy (into->name, "sim");
+    into->input = true;
+    into->output = true;
+    into->system = false;
+    return true;
+}
+
+/** Open a device for input */
+static midi_port *sim_open_input (int devid) {
+    if (devid < 0 || devid >= SIM_DEVICES) return NULL;
+    midi_port *res = (midi_port *) malloc (sizeof (midi_port));
+    res->devid = devid;
+    res->latency = 0;
+    return res;
+}
+
+/** Open a device for output */
+static midi_port *sim_open_output (int devid, int latency) {
+    if (devid < 0 || devid >= SIM_DEVICES) return NULL;
+    midi_port *res = (midi_port *) malloc (sizeof (midi_port));
+    res->devid = devid;
+    res->latency = latency;
+    return res;
+}
+
+/** Close a port */
+static void sim_close (midi_port *p) {
+    free (p);
+}
+
+/** Never blocks, there is either input queued or there isn't */
+static int sim_wait (midi_port **ports, int nports, int timeout_ms) {
+    return SIM.count ? 1 : 0;
+}
+
+/** Read queued input, stamped with the current time. Input for devices
+  * that aren't in the set of ports gets dropped, like a real device
+  * nobody listens to.
+  */
+static int sim_read (midi_port **ports, int nports, midi_msg *into,
+                     int count) {
+    uint64_t now = getclock();
+    int taken = 0;
+    int res = 0;
+    while (taken < SIM.count && res < count) {
+        siminput *in = SIM.queue + taken++;
+        for (int p=0; p<nports; ++p) {
+            if (ports[p]->devid != in->devid) continue;
+            into[res].message = in->message;
+            into[res].source = p;
+            into[res].when = now;
+            res++;
+            break;
+        }
+    }
+    memmove (SIM.queue, SIM.queue + taken,
+             (SIM.count - taken) * sizeof (siminput));
+    SIM.count -= taken;
+    return res;
+}
+
+/** Log a batch of messages, one line each with the time of writing, the
+  * time of delivery, the device number and the message bytes. Like a
+  * real device with a latency set, timestamped messages are delivered
+  * at their timestamp, or right away if that has passed.
+  */
+static bool sim_write (midi_port *p, const midi_msg *msgs, int count) {
+    SIM.written += count;
+    if (! SIM.out) return true;
+    uint64_t now = getclock();
+    for (int i=0; i<count; ++i) {
+        uint64_t at = now;
+        if (p->latency && msgs[i].when > now) at = msgs[i].when;
+        uint32_t m = msgs[i].message;
+        uint8_t status = m & 0xff;
+        int len = 3;
+        if (status >= 0xf0 && status != 0xf2) len = 1;
+        else if ((status & 0xe0) == 0xc0) len = 2;
+        fprintf (SIM.out, "%llu %llu %i",
+                 (unsigned long long) (now - SIM.epoch),
+                 (unsigned long long) (at - SIM.epoch), p->devid + 1);
+        for (int b=0; b<len; ++b) {
+            fprintf (SIM.out, " %02x", (m >> (8*b)) & 0xff);
+        }
+        fputc ('\n', SIM.out);
+    }
+    return true;
+}
+
+/** The simulated backend, used in SIMULATION builds */
+midi_backend MIDI_SIM = {
+    .name = "sim",
+    .init = sim_init,
+    .available = sim_available,
+    .count_devices = sim_count_devices,
+    .get_device = sim_get_device,
+    .open_input = sim_open_input,
+    .open_output = sim_open_output,
+    .close = sim_close,
+    .wait = sim_wait,
+    .read = sim_read,
+    .write = sim_write
+};
@@ -0,0 +1,317 @@
+/** Throughput and latency benchmarks for the MIDI engine. Drives the
+  * receive, engine and write stages through the simulated backend, the
+  * way the simulator does, with output going nowhere. The engine runs on
+  * a virtual clock, so every run does exactly the same work; only the
+  * time each pass takes is measured, on the real clock.
+  *
+  * Build with -DSIMULATION, see README.md. Usage: tmbench [scale], where
+  * scale multiplies the number of passes of every benchmark (default 1).
+  *
+  * Prints a line per benchmark, with space separated fields:
+  *
+  *     name      Benchmark name
+  *     passes    Number of measured passes through the stages
+  *     events    Number of events handled: input messages, clock ticks,
+  *               engine wakeups or preset switches, depending on the
+  *               benchmark
+  *     output    Number of messages written
+  *     evps      Events per second
+  *     nsev      Mean ns per event
+  *     p50 p99 p999 max
+  *               Pass time percentiles and maximum, in ns
+  *
+  * Lines starting with '#' are comments.
+  */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/utsname.h>
+#include "presets.h"
+#include "steps.h"
+#include "midi.h"
+#include "tempo.h"
+#include "sim.h"
+#include "snapshot.h"
+
+/** Most pass times kept per benchmark */
+#define BENCH_SAMPLES 200000
+
+/** Virtual time the benchmarks start at */
+#define BENCH_EPOCH CLOCK_SEC
+
+/** Note of the first trigger in the custom map */
+#define BENCH_NOTE 36
+
+context_global CTX;
+
+/** Benchmark state */
+static struct benchstate {
+    uint64_t         clock; /**< The virtual clock */
+    uint64_t         next; /**< Next engine deadline, 0 for none */
+    uint64_t         samples[BENCH_SAMPLES]; /**< Pass times in ns */
+    int              nsamples; /**< Number of pass times kept */
+    uint64_t         events; /**< Events handled */
+    uint64_t         total; /**< Sum of the pass times in ns */
+    uint64_t         output; /**< Output count at the start */
+    int              scale; /**< Pass count multiplier */
+} B;
+
+/** Time source for getclock() */
+static uint64_t bench_getclock (void) {
+    return B.clock;
+}
+
+/** Returns the real time in ns */
+static uint64_t bench_realtime (void) {
+    struct timespec ts;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return ((uint64_t) ts.tv_sec * CLOCK_SEC) + ts.tv_nsec;
+}
+
+/** There are no buttons to flash */
+void button_manager_flash_midi_in (void) {}
+void button_manager_flash_midi_out (void) {}
+
+/** Run the stages once, without measuring */
+static void bench_run (void) {
+    midi_input_tick (0);
+    B.next = midi_engine_tick();
+    midi_output_tick();
+}
+
+/** Record the time a pass took.
+  * \param start The real time the pass started.
+  * \param events The number of events the pass handled.
+  */
+static void bench_record (uint64_t start, int events) {
+    uint64_t took = bench_realtime() - start;
+    if (B.nsamples < BENCH_SAMPLES) B.samples[B.nsamples++] = took;
+    B.total += took;
+    B.events += events;
+}
+
+/** Run the stages once and record the time it took */
+static void bench_pass (int events) {
+    uint64_t start = bench_realtime();
+    bench_run();
+    bench_record (start, events);
+}
+
+/** Move the virtual clock to the next engine deadline, if that comes
+  * before a limit.
+  * \return false if the limit comes first.
+  */
+static bool bench_advance (uint64_t limit) {
+    if (! B.next || B.next > limit) return false;
+    if (B.next > B.clock) B.clock = B.next;
+    return true;
+}
+
+/** Silence everything and let the engine settle, then start measuring */
+static void bench_begin (void) {
+    midi_stop_sequencer();
+    B.clock += CLOCK_SEC;
+    bench_run();
+    B.nsamples = 0;
+    B.events = B.total = 0;
+    B.output = sim_output_count();
+}
+
+/** Sorts pass times */
+static int bench_compare (const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *) a;
+    uint64_t y = *(const uint64_t *) b;
+    return (x > y) - (x < y);
+}
+
+/** Returns a percentile of the sorted pass times */
+static uint64_t bench_percentile (int per1000) {
+    if (! B.nsamples) return 0;
+    int i = (int) (((int64_t) B.nsamples * per1000) / 1000);
+    if (i >= B.nsamples) i = B.nsamples - 1;
+    return B.samples[i];
+}
+
+/** Print the results of a benchmark */
+static void bench_report (const char *name) {
+    qsort (B.samples, B.nsamples, sizeof (uint64_t), bench_compare);
+    double evps = B.total ? (double) B.events * 1e9 / B.total : 0.0;
+    double nsev = B.events ? (double) B.total / B.events : 0.0;
+    printf ("%s %d %llu %llu %.0f %.1f %llu %llu %llu %llu\n", name,
+            B.nsamples, (unsigned long long) B.events,
+            (unsigned long long) (sim_output_count() - B.output), evps, nsev,
+            (unsigned long long) bench_percentile (500),
+            (unsigned long long) bench_percentile (990),
+            (unsigned long long) bench_percentile (999),
+            (unsigned long long) (B.nsamples ? B.samples[B.nsamples-1] : 0));
+    fflush (stdout);
+}
+
+/** Set up a trigger.
+  * \param trig The trigger (0-11).
+  * \param notes Number of notes, counting up from the trigger's note.
+  * \param send Chord or sequence.
+  * \param nmode Note length for chords.
+  */
+static void bench_trigger (int trig, int notes, sendconfig send,
+                           notemode nmode) {
+    triggerpreset *tp = CTX.preset.triggers + trig;
+    memset (tp, 0, sizeof (triggerpreset));
+    for (int i=0; i<notes; ++i) tp->notes[i] = 24 + trig*8 + i;
+    tp->lastnote = notes-1;
+    tp->send = send;
+    tp->nmode = nmode;
+    tp->slen = 16;
+    tp->sgate = 50;
+    tp->move = MOVE_LOOP_UP;
+    tp->vconf = VELO_COPY;
+    steps_compile (CTX.steps + trig, tp);
+    snapshot_publish (&CTX.preset, CTX.steps);
+}
+
+/** Note On and Off for a trigger as input */
+static void bench_noteon (int trig) {
+    sim_push_input (0, 0x90 | (BENCH_NOTE + trig) << 8 | 100 << 16);
+}
+static void bench_noteoff (int trig) {
+    sim_push_input (0, 0x80 | (BENCH_NOTE + trig) << 8);
+}
+
+/** A flood of single notes on all triggers, 64 messages per pass */
+static void bench_flood (void) {
+    for (int i=0; i<12; ++i) bench_trigger (i, 1, SEND_NOTES, NMODE_GATE);
+    bench_begin();
+    for (int p=0; p<20000 * B.scale; ++p) {
+        for (int i=0; i<32; ++i) {
+            bench_noteon ((p+i) % 12);
+            bench_noteoff ((p+i) % 12);
+        }
+        bench_pass (64);
+        B.clock += 100 * CLOCK_USEC;
+    }
+    bench_report ("flood");
+}
+
+/** All 12 triggers hit at once, each with an 8 note chord of fixed
+  * length. Passes alternate between the hits and the timed note-offs
+  * they leave behind on the schedule.
+  */
+static void bench_chords (void) {
+    for (int i=0; i<12; ++i) {
+        bench_trigger (i, 8, SEND_NOTES, NMODE_FIXED_16);
+    }
+    bench_begin();
+    for (int p=0; p<5000 * B.scale; ++p) {
+        for (int i=0; i<12; ++i) bench_noteon (i);
+        bench_pass (12);
+        uint64_t limit = B.clock + CLOCK_SEC;
+        while (bench_advance (limit)) bench_pass (1);
+        for (int i=0; i<12; ++i) bench_noteoff (i);
+        bench_pass (12);
+        B.clock += 10 * CLOCK_MSEC;
+    }
+    bench_report ("chords");
+}
+
+/** Twelve layered sequences running side by side at the top tempo */
+static void bench_steps (void) {
+    CTX.preset.seqmode = SEQMODE_LAYERED;
+    for (int i=0; i<12; ++i) bench_trigger (i, 8, SEND_SEQUENCE, 0);
+    bench_begin();
+    for (int i=0; i<12; ++i) bench_noteon (i);
+    bench_pass (12);
+    for (int p=0; p<50000 * B.scale; ++p) {
+        if (! bench_advance ((uint64_t) -1)) break;
+        bench_pass (1);
+    }
+    bench_report ("steps");
+    CTX.preset.seqmode = SEQMODE_SINGLE;
+}
+
+/** Twelve layered sequences following an external clock at the top
+  * tempo, one clock tick per pass plus the steps due in between.
+  */
+static void bench_extclock (void) {
+    uint64_t tick = (60ULL * CLOCK_SEC * 100) / (TEMPO_MAX * 24);
+    CTX.ext_sync = 1;
+    CTX.preset.seqmode = SEQMODE_LAYERED;
+    midi_apply_settings();
+    for (int i=0; i<12; ++i) bench_trigger (i, 8, SEND_SEQUENCE, 0);
+    bench_begin();
+    sim_push_input (0, 0xfa);
+    bench_run();
+    for (int i=0; i<12; ++i) bench_noteon (i);
+    bench_run();
+    uint64_t at = B.clock;
+    for (int p=0; p<50000 * B.scale; ++p) {
+        at += tick;
+        while (bench_advance (at - 1)) bench_pass (0);
+        B.clock = at;
+        sim_push_input (0, 0xf8);
+        bench_pass (1);
+    }
+    bench_report ("extclock");
+    CTX.ext_sync = 0;
+    CTX.preset.seqmode = SEQMODE_SINGLE;
+    midi_apply_settings();
+}
+
+/** Switch between presets as fast as possible while a sequence runs,
+  * the way the preset buttons load one, with every switch taking over
+  * right away.
+  */
+static void bench_presets (void) {
+    static preset presets[2];
+    for (int i=0; i<12; ++i) bench_trigger (i, 8, SEND_SEQUENCE, 0);
+    memcpy (presets, &CTX.preset, sizeof (preset));
+    for (int i=0; i<12; ++i) bench_trigger (i, 4, SEND_SEQUENCE, 0);
+    CTX.preset.tempo = 90;
+    memcpy (presets + 1, &CTX.preset, sizeof (preset));
+    CTX.preset_switch = SWITCH_NOW;
+    bench_begin();
+    bench_noteon (0);
+    bench_run();
+    for (int p=0; p<20000 * B.scale; ++p) {
+        uint64_t start = bench_realtime();
+        memcpy (&CTX.preset, presets + (p & 1), sizeof (preset));
+        for (int i=0; i<12; ++i) {
+            steps_compile (CTX.steps + i, CTX.preset.triggers + i);
+        }
+        snapshot_queue (&CTX.preset, CTX.steps);
+        midi_apply_preset();
+        bench_run();
+        bench_record (start, 1);
+        B.clock += 5 * CLOCK_MSEC;
+        while (bench_advance (B.clock)) bench_run();
+    }
+    bench_report ("presets");
+    CTX.preset_switch = SWITCH_BAR;
+}
+
+int main (int argc, const char *argv[]) {
+    B.scale = (argc > 1) ? atoi (argv[1]) : 1;
+    if (B.scale < 1) B.scale = 1;
+
+    B.clock = BENCH_EPOCH;
+    thread_set_clock (bench_getclock);
+    sim_setup (NULL, BENCH_EPOCH);
+    srand (1);
+
+    CTX.trigger_type[0] = TYPE_CUSTOM;
+    for (int i=0; i<12; ++i) CTX.custom_map[BENCH_NOTE + i] = i+1;
+    CTX.preset.tempo = TEMPO_MAX / 100;
+    for (int i=0; i<12; ++i) bench_trigger (i, 1, SEND_NOTES, NMODE_GATE);
+    midi_init_simulation();
+    midi_check_ports();
+
+    struct utsname u;
+    if (uname (&u) == 0) printf ("# %s %s\n", u.sysname, u.machine);
+    printf ("# name passes events output evps nsev p50 p99 p999 max\n");
+    bench_flood();
+    bench_chords();
+    bench_steps();
+    bench_extclock();
+    bench_presets();
+    return 0;
+}
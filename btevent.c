@@ -1,11 +1,20 @@
 #include "btevent.h"
+#include "stats.h"
 #include <unistd.h>
 #include <pifacecad.h>
-#include <stdlib.h>
 #include <time.h>
 
 button_manager BT;
 
+/** Events that are coalesced: the queue holds at most one of each kind,
+  * and a new one is dropped while the last one wasn't taken yet. For
+  * the indicators, the UI gets the latest state when it takes the
+  * event, so an on and off in between collapse. */
+#define BTPEND_REPEAT 0x01 /**< Key repeat */
+#define BTPEND_IDLE   0x02 /**< Empty event, for periodic UI work */
+#define BTPEND_MDIN   0x04 /**< MIDI in indicator */
+#define BTPEND_MDOUT  0x08 /**< MIDI out indicator */
+
 /** Microsleeper. If someone can explain why gcc hates both usleep() and
   * nanosleep() under C99 and not sound like a douche, they win a prize.
   */
@@ -30,10 +39,16 @@ void button_manager_init (void) {
     BT.tick_midi_in = 0;
     BT.tick_midi_out = 0;
     conditional_init (&BT.eventcond);
-    BT.first = BT.last = NULL;
+    for (int i=0; i<BT_EVENTS; ++i) BT.events[i].seq = i;
+    BT.head = BT.tail = 0;
+    BT.pending = 0;
+    BT.overflows = 0;
+    stats_counter ("buttons-lost", &BT.overflows);
+    BT.light_midi_in = BT.light_midi_out = false;
+    for (int i=0; i<BT_HELD; ++i) BT.held[i].inuse = false;
+    BT.nextheld = 0;
     BT.useshift = true;
-    pthread_mutex_init (&BT.lock, NULL);
-    thread_init (&BT.super, button_manager_main, NULL);
+    thread_init (&BT.super, THREAD_UI, button_manager_main, NULL);
 }
 
 /** Thread loop for the button manager. Reads the button state about every
@@ -97,6 +112,7 @@ void button_manager_main (thread *t) {
             button_manager_add_event (BTMASK_MDOUT_OFF, false);
         }
         
+        stats_poll();
         musleep (50000);
         BT.tick++;
         if ((BT.tick & 31) == 0) button_manager_add_event (0,false);
@@ -111,55 +127,122 @@ void button_manager_flash_midi_out (void) {
     BT.tick_midi_out = BT.tick;
 }
 
-/** Adds a button event to the queue and signals any consumers.
+/** Returns the BTPEND_* bit of an event that gets coalesced, 0 for
+  * one that doesn't.
+  */
+static uint32_t button_event_pendbit (uint8_t buttons, bool isrepeat) {
+    if (isrepeat) return BTPEND_REPEAT;
+    switch (buttons) {
+        case 0: return BTPEND_IDLE;
+        case BTMASK_MDIN_ON: case BTMASK_MDIN_OFF: return BTPEND_MDIN;
+        case BTMASK_MDOUT_ON: case BTMASK_MDOUT_OFF: return BTPEND_MDOUT;
+    }
+    return 0;
+}
+
+/** Put an event in the queue. Lock-free, safe for any number of
+  * producers: each claims a queue position, fills the slot at it and
+  * then marks it filled, through the slot's sequence number.
+  * \return false if the queue is full.
+  */
+static bool button_manager_push (uint8_t buttons, bool isrepeat) {
+    uint32_t pos = __atomic_load_n (&BT.head, __ATOMIC_RELAXED);
+    button_slot *s;
+    while (1) {
+        s = BT.events + (pos & (BT_EVENTS-1));
+        uint32_t seq = __atomic_load_n (&s->seq, __ATOMIC_ACQUIRE);
+        int32_t diff = (int32_t) (seq - pos);
+        if (diff < 0) return false;
+        if (diff > 0) {
+            pos = __atomic_load_n (&BT.head, __ATOMIC_RELAXED);
+        }
+        else if (__atomic_compare_exchange_n (&BT.head, &pos, pos+1, true,
+                                              __ATOMIC_RELAXED,
+                                              __ATOMIC_RELAXED)) break;
+    }
+    s->buttons = buttons;
+    s->isrepeat = isrepeat;
+    __atomic_store_n (&s->seq, pos+1, __ATOMIC_RELEASE);
+    return true;
+}
+
+/** Take the oldest event off the queue. UI thread only.
+  * \return false if the queue is empty.
+  */
+static bool button_manager_pop (button_event *e) {
+    button_slot *s = BT.events + (BT.tail & (BT_EVENTS-1));
+    uint32_t seq = __atomic_load_n (&s->seq, __ATOMIC_ACQUIRE);
+    if (seq != BT.tail+1) return false;
+    e->buttons = s->buttons;
+    e->isrepeat = s->isrepeat;
+    __atomic_store_n (&s->seq, BT.tail + BT_EVENTS, __ATOMIC_RELEASE);
+    BT.tail++;
+
+    /* Clear the pending bit before reading the indicator state, so a
+       change after this gets its own event */
+    uint32_t bit = button_event_pendbit (e->buttons, e->isrepeat);
+    if (bit) __atomic_and_fetch (&BT.pending, ~bit, __ATOMIC_ACQ_REL);
+    if (bit == BTPEND_MDIN) {
+        e->buttons = __atomic_load_n (&BT.light_midi_in, __ATOMIC_ACQUIRE)
+                     ? BTMASK_MDIN_ON : BTMASK_MDIN_OFF;
+    }
+    else if (bit == BTPEND_MDOUT) {
+        e->buttons = __atomic_load_n (&BT.light_midi_out, __ATOMIC_ACQUIRE)
+                     ? BTMASK_MDOUT_ON : BTMASK_MDOUT_OFF;
+    }
+    return true;
+}
+
+/** Adds a button event to the queue and signals any consumers. Key
+  * repeats, empty events and indicator changes are coalesced with one
+  * of their kind that is still queued. Never allocates, and drops the
+  * event if the queue is full.
   * \param buttons Bitmask of the buttons pressed.
   * \param isrepeat True if this is a key repeat event.
   */
 void button_manager_add_event (uint8_t buttons, bool isrepeat) {
-    button_event *e = (button_event *) malloc (sizeof (button_event));
-    e->next = NULL;
-    e->buttons = buttons;
-    e->isrepeat = isrepeat;
-    pthread_mutex_lock (&BT.lock);
-    if (BT.last) {
-        BT.last->next = e;
-        BT.last = e;
+    uint32_t bit = button_event_pendbit (buttons, isrepeat);
+    if (bit == BTPEND_MDIN) {
+        __atomic_store_n (&BT.light_midi_in, buttons == BTMASK_MDIN_ON,
+                          __ATOMIC_RELEASE);
+    }
+    else if (bit == BTPEND_MDOUT) {
+        __atomic_store_n (&BT.light_midi_out, buttons == BTMASK_MDOUT_ON,
+                          __ATOMIC_RELEASE);
     }
-    else {
-        BT.first = BT.last = e;
+    if (bit && (__atomic_fetch_or (&BT.pending, bit, __ATOMIC_ACQ_REL) &
+                bit)) return;
+    if (! button_manager_push (buttons, isrepeat)) {
+        if (bit) __atomic_and_fetch (&BT.pending, ~bit, __ATOMIC_ACQ_REL);
+        __atomic_add_fetch (&BT.overflows, 1, __ATOMIC_RELAXED);
+        return;
     }
-    pthread_mutex_unlock (&BT.lock);
     conditional_signal (&BT.eventcond);
 }
 
 /** Waits for a button_event to enter the queue, takes it
-  * off and returns it.
+  * off and returns it. The event has to be handed back through
+  * button_event_free(). UI thread only.
   * \param useshift If true, shift key on its own spawns no events.
   */
 button_event *button_manager_wait_event (bool useshift) {
     BT.useshift = useshift;
-    button_event *e = NULL;
-    while (1) {
-        if (BT.first) {
-            pthread_mutex_lock (&BT.lock);
-            e = BT.first;
-            if (e) {
-                if (e->next) {
-                    BT.first = e->next;
-                    e->next = NULL;
-                }
-                else {
-                    BT.first = BT.last = NULL;
-                }
-            }
-            pthread_mutex_unlock (&BT.lock);
-            if (e) return e;
-        }
-        conditional_wait (&BT.eventcond);
-    }
+    button_event ev;
+    while (! button_manager_pop (&ev)) conditional_wait (&BT.eventcond);
+
+    /* Events are handed out from a small pool. If a caller forgot to
+       free one, it gets reused anyway */
+    int i = 0;
+    while (i < BT_HELD && BT.held[(BT.nextheld + i) % BT_HELD].inuse) i++;
+    button_event *e = BT.held + (BT.nextheld + i) % BT_HELD;
+    BT.nextheld = (BT.nextheld + i + 1) % BT_HELD;
+    e->buttons = ev.buttons;
+    e->isrepeat = ev.isrepeat;
+    e->inuse = true;
+    return e;
 }
 
-/** Free event memory */
+/** Hand an event back to the pool */
 void button_event_free (button_event *e) {
-    free (e);
+    e->inuse = false;
 }
@@ -30,14 +30,28 @@
 #define BTMASK_MDOUT_ON  0xf2
 #define BTMASK_MDOUT_OFF 0xf3
 
+/** Number of slots in the event queue, a power of two */
+#define BT_EVENTS 32
+
+/** Number of events that can be handed out to the UI at once */
+#define BT_HELD 4
+
 /** Event flowing out of the button manager. Represents a specific
     configuration of buttons pressed. */
 typedef struct button_event_s {
-    struct button_event_s   *next; /**< List-link for the queue */
     uint8_t                  buttons; /**< Button state */
     bool                     isrepeat; /**< true if it's a repetition */
+    bool                     inuse; /**< Handed out, not freed yet */
 } button_event;
 
+/** Slot of the event queue */
+typedef struct button_slot_s {
+    uint32_t                 seq; /**< Queue position the slot is ready
+                                       for, plus one once it's filled */
+    uint8_t                  buttons; /**< Button state */
+    bool                     isrepeat; /**< true if it's a repetition */
+} button_slot;
+
 /** Represents the state of a single button */
 typedef struct button_state_s {
     bool        pressed; /**< true if button is pressed */
@@ -52,10 +66,17 @@ typedef struct button_manager_s {
     uint64_t         tick_midi_in; /**< Tick of last MIDI event */
     uint64_t         tick_midi_out; /**< Tick of last MIDI out event */
     conditional      eventcond; /**< Conditional for new events */
-    button_event    *first; /**< Linked-list head */
-    button_event    *last; /**< Linked-list tail */
+    button_slot      events[BT_EVENTS]; /**< Event queue */
+    uint32_t         head; /**< Next queue position to write */
+    uint32_t         tail; /**< Next queue position to read, UI only */
+    uint32_t         pending; /**< BTPEND_* bits of coalesced events in
+                                   the queue */
+    uint32_t         overflows; /**< Events dropped on a full queue */
+    bool             light_midi_in; /**< Latest MIDI in indicator state */
+    bool             light_midi_out; /**< Latest MIDI out indicator state */
+    button_event     held[BT_HELD]; /**< Events handed out to the UI */
+    int              nextheld; /**< Next of those to hand out */
     bool             useshift; /**< True if we should treat shift as shift */
-    pthread_mutex_t  lock; /**< Mutex for the event queue */
 } button_manager;
 
 /* ============================== GLOBALS ============================== */
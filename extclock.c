@@ -0,0 +1,127 @@
+#include "extclock.h"
+#include "thread.h"
+#include <math.h>
+
+/** Loop bandwidth while acquiring, relative to the tick rate */
+#define EXTCLOCK_BW_ACQUIRE 0.3
+
+/** Loop bandwidth once locked, relative to the tick rate */
+#define EXTCLOCK_BW_LOCKED 0.05
+
+/** Number of ticks within tolerance before we call it locked */
+#define EXTCLOCK_SETTLE 12
+
+/** Number of ticks far off before we assume a tempo change */
+#define EXTCLOCK_OUTLIERS 3
+
+/** Number of missing ticks after which the clock counts as stopped */
+#define EXTCLOCK_TIMEOUT 4
+
+/** Reset the follower, the next tick starts a new acquisition */
+void extclock_init (extclock *self) {
+    self->ticks = 0;
+    self->position = 0;
+    self->last = 0;
+    self->next = self->period = self->beat = 0.0;
+    self->jitter = 0.0;
+    self->settled = self->outliers = 0;
+    self->locked = false;
+}
+
+/** Start tracking from a measured tick interval */
+static void extclock_acquire (extclock *self, uint64_t when) {
+    self->period = (double) (when - self->last);
+    self->next = (double) when + self->period;
+    self->settled = self->outliers = 0;
+    self->locked = false;
+}
+
+/** Feed the arrival time of a clock tick into the loop */
+void extclock_tick (extclock *self, uint64_t when) {
+    /* A long gap means the clock was stopped, start over from the
+       song position we were given */
+    if (self->ticks > 1 &&
+        (double) (when - self->last) > EXTCLOCK_TIMEOUT * self->period) {
+        uint64_t pos = self->position;
+        extclock_init (self);
+        self->position = pos;
+    }
+    
+    if (self->ticks == 0) {
+        if (! (self->position % EXTCLOCK_PPQ)) self->beat = (double) when;
+    }
+    else if (self->ticks == 1) {
+        extclock_acquire (self, when);
+    }
+    else {
+        double e = (double) when - self->next;
+        double ae = fabs (e);
+        
+        if (ae > self->period / 2) {
+            /* A few of these in a row means the tempo changed */
+            if (++self->outliers >= EXTCLOCK_OUTLIERS) {
+                extclock_acquire (self, when);
+                if (! (self->position % EXTCLOCK_PPQ)) self->beat = when;
+                self->last = when;
+                self->ticks++;
+                self->position++;
+                return;
+            }
+            /* Don't let a single late tick pull us too far */
+            e = (e < 0) ? -self->period / 2 : self->period / 2;
+        }
+        else {
+            self->outliers = 0;
+            self->jitter += (ae - self->jitter) / 16;
+        }
+        
+        double w = self->locked ? EXTCLOCK_BW_LOCKED : EXTCLOCK_BW_ACQUIRE;
+        double t = self->next + 1.414 * w * e;
+        self->period += w * w * e;
+        self->next = t + self->period;
+        
+        /* Tolerance is 10% of a tick, but at least a millisecond */
+        double tol = self->period / 10;
+        if (tol < CLOCK_MSEC) tol = CLOCK_MSEC;
+        if (ae < tol) {
+            if (++self->settled >= EXTCLOCK_SETTLE) self->locked = true;
+        }
+        else self->settled = 0;
+        
+        if (! (self->position % EXTCLOCK_PPQ)) self->beat = t;
+    }
+    self->last = when;
+    self->ticks++;
+    self->position++;
+}
+
+/** Set the song position of the next tick, in ticks. Used for Start
+  * and Song Position Pointer, so beats line up with the song. Doesn't
+  * disturb the loop.
+  */
+void extclock_position (extclock *self, uint64_t pos) {
+    self->position = pos;
+}
+
+/** Returns true if the loop is locked, and ticks are still coming in
+  * at the time given.
+  */
+bool extclock_running (extclock *self, uint64_t now) {
+    if (! self->locked) return false;
+    return ((double) (now - self->last) < EXTCLOCK_TIMEOUT * self->period);
+}
+
+/** Returns the filtered quarter note length */
+uint64_t extclock_qnote (extclock *self) {
+    return (uint64_t) (self->period * EXTCLOCK_PPQ + 0.5);
+}
+
+/** Returns the filtered time of the most recent beat */
+uint64_t extclock_beat (extclock *self) {
+    return (uint64_t) (self->beat + 0.5);
+}
+
+/** Returns the estimated jitter of the incoming clock in microseconds */
+int extclock_jitter_us (extclock *self) {
+    return (int) (self->jitter / CLOCK_USEC);
+}
@@ -0,0 +1,40 @@
+#ifndef _EXTCLOCK_H
+#define _EXTCLOCK_H 1
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* =============================== TYPES =============================== */
+
+/** MIDI clock ticks per quarter note */
+#define EXTCLOCK_PPQ 24
+
+/** Follower for an external MIDI clock. A second order delay-locked
+  * loop filters the tick arrival times, and tracks both the tick period
+  * and the phase of the incoming clock. All times are in getclock()
+  * units.
+  */
+typedef struct extclock_s {
+    uint64_t         ticks; /**< Ticks seen since (re)acquisition */
+    uint64_t         position; /**< Song position of the next tick */
+    uint64_t         last; /**< Arrival time of the last tick */
+    double           next; /**< Predicted time of the next tick */
+    double           period; /**< Filtered tick period */
+    double           beat; /**< Filtered time of the last beat */
+    double           jitter; /**< Smoothed absolute prediction error */
+    int              settled; /**< Consecutive ticks near prediction */
+    int              outliers; /**< Consecutive ticks far off prediction */
+    bool             locked; /**< True if the loop has settled */
+} extclock;
+
+/* ============================= FUNCTIONS ============================= */
+
+void         extclock_init (extclock *);
+void         extclock_tick (extclock *, uint64_t);
+void         extclock_position (extclock *, uint64_t);
+bool         extclock_running (extclock *, uint64_t);
+uint64_t     extclock_qnote (extclock *);
+uint64_t     extclock_beat (extclock *);
+int          extclock_jitter_us (extclock *);
+
+#endif
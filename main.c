@@ -1,48 +1,70 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stddef.h>
+#include <signal.h>
 #include "btevent.h"
 #include "lcd.h"
 #include "ui.h"
 #include "presets.h"
+#include "steps.h"
+#include "snapshot.h"
+#include "store.h"
+#include "thread.h"
+#include "stats.h"
 #include "daemon.h"
 
 context_global CTX;
 
+/** Match the key of a per-port setting, which is the name for the
+  * first port, or the name followed by the port number (2-n) for the
+  * others, and then a colon.
+  * \param buf The config line.
+  * \param name The key name.
+  * \param count The number of ports.
+  * \return The port index, or -1 if the key doesn't match.
+  */
+static int context_port_key (const char *buf, const char *name, int count) {
+    size_t len = strlen (name);
+    if (strncmp (buf, name, len) != 0) return -1;
+    if (buf[len] == ':') return 0;
+    int port = buf[len] - '1';
+    if (port > 0 && port < count && buf[len+1] == ':') return port;
+    return -1;
+}
+
+/** Returns the value of a per-port setting, after the colon */
+static const char *context_port_value (const char *buf) {
+    return strchr (buf, ':') + 1;
+}
+
+/** Fill in the defaults of a preset that was never stored */
+static void context_default_preset (int bank, int nr, preset *p) {
+    memset (p, 0, sizeof (preset));
+    p->tempo = 125;
+    if (bank == 1 && nr == 1) {
+        static const char notes[9] = {48,53,55,56,58,59,60,62,63};
+        strcpy (p->name, "Rendez-vous    ");
+        for (int i=0; i<9; ++i) p->triggers[i].notes[0] = notes[i];
+        return;
+    }
+    strcpy (p->name, "Init         ");
+    for (int i=0; i<12; ++i) {
+        triggerpreset *tp = p->triggers + i;
+        tp->slen = 8;
+        tp->move = MOVE_LOOP_UP;
+        tp->notes[0] = 48+i;
+    }
+}
+
 void context_init (void) {
     memset (&CTX, 0, sizeof (CTX));
-    strcpy (CTX.presets[1].name, "Rendez-vous    ");
-    CTX.presets[1].tempo = 125;
-    CTX.presets[1].triggers[0].notes[0] = 48;
-    CTX.presets[1].triggers[1].notes[0] = 53;
-    CTX.presets[1].triggers[2].notes[0] = 55;
-    CTX.presets[1].triggers[3].notes[0] = 56;
-    CTX.presets[1].triggers[4].notes[0] = 58;
-    CTX.presets[1].triggers[5].notes[0] = 59;
-    CTX.presets[1].triggers[6].notes[0] = 60;
-    CTX.presets[1].triggers[7].notes[0] = 62;
-    CTX.presets[1].triggers[8].notes[0] = 63;
-    CTX.trigger_type = TYPE_ROLAND_TR8;
+    for (int i=0; i<INPUT_PORTS; ++i) CTX.trigger_type[i] = TYPE_ROLAND_TR8;
+    store_open ("/boot/tmpreset.dat");
+    CTX.bank_nr = 1;
     context_load_preset (1);
     
-    for (int cpre=2; cpre<100; ++cpre) {
-        strcpy (CTX.presets[cpre].name, "Init         ");
-        CTX.presets[cpre].tempo = 125;
-        for (int i=0; i<12; ++i) {
-            triggerpreset *tp = &CTX.presets[cpre].triggers[i];
-            tp->slen = 8;
-            tp->move = MOVE_LOOP_UP;
-            tp->notes[0] = 48+i;
-        }
-    }
-    
-    FILE *pst = fopen ("/boot/tmpreset.dat","r");
-    if (pst) {
-        fread (CTX.presets, sizeof(preset), 100, pst);
-        fclose (pst);
-    }
-    
-    pst = fopen ("/boot/tmglobal.dat","r");
+    FILE *pst = fopen ("/boot/tmglobal.dat","r");
     if (pst) {
         char buf[1024];
         while (! feof (pst)) {
@@ -52,15 +74,35 @@ void context_init (void) {
             if (*buf == 0) continue;
             char *l = buf + strlen(buf)-1;
             if (*l == '\n') *l = 0;
+            int port;
             
-            if (strncmp (buf, "inport:", 7) == 0) {
-                strcpy (CTX.portname_midi_in, buf+7);
+            /* Per-port settings are <key>:<value> for the first port,
+               and <key><2-4>:<value> for the others */
+            if ((port = context_port_key (buf, "inport", INPUT_PORTS)) >= 0) {
+                strcpy (CTX.portname_midi_in[port], context_port_value (buf));
+            }
+            else if ((port = context_port_key (buf, "outport",
+                                               OUTPUT_PORTS)) >= 0) {
+                strcpy (CTX.portname_midi_out[port], context_port_value (buf));
+            }
+            else if ((port = context_port_key (buf, "triggertype",
+                                               INPUT_PORTS)) >= 0) {
+                CTX.trigger_type[port] =
+                    (triggertype) atoi (context_port_value (buf));
             }
-            else if (strncmp (buf, "outport:", 8) == 0) {
-                strcpy (CTX.portname_midi_out, buf+8);
+            else if ((port = context_port_key (buf, "inchannel",
+                                               INPUT_PORTS)) >= 0) {
+                int chan = atoi (context_port_value (buf));
+                CTX.in_channel[port] = (chan < 0 || chan > 16) ? 0 : chan;
             }
-            else if (strncmp (buf, "triggertype:", 12) == 0) {
-                CTX.trigger_type = (triggertype) atoi (buf+12);
+            else if (strncmp (buf, "map:", 4) == 0) {
+                /* map:<note>:<trigger 1-12> */
+                int note = atoi (buf+4);
+                char *t = strchr (buf+4, ':');
+                int trig = t ? atoi (t+1) : 0;
+                if (note >= 0 && note < 128 && trig >= 0 && trig <= 12) {
+                    CTX.custom_map[note] = trig;
+                }
             }
             else if (strncmp (buf, "sendchannel:", 12) == 0) {
                 CTX.send_channel = atoi (buf+12) - 1;
@@ -68,6 +110,37 @@ void context_init (void) {
             else if (strncmp (buf, "extsync:",8) == 0) {
                 CTX.ext_sync = atoi (buf+8);
             }
+            else if (strncmp (buf, "clockout:",9) == 0) {
+                CTX.clock_out = atoi (buf+9);
+            }
+            else if (strncmp (buf, "lookahead:",10) == 0) {
+                /* Rounded down to what the setup menu offers */
+                static const int choices[] = {0,5,10,20,40};
+                int ms = atoi (buf+10);
+                CTX.lookahead = 0;
+                for (int i=0; i<5; ++i) {
+                    if (ms >= choices[i]) CTX.lookahead = choices[i];
+                }
+            }
+            else if (strncmp (buf, "backend:",8) == 0) {
+                if (strcmp (buf+8, "portmidi") == 0) {
+                    CTX.backend = BACKEND_PORTMIDI;
+                }
+                else CTX.backend = BACKEND_ALSA;
+            }
+            else if (strncmp (buf, "outlink:",8) == 0) {
+                if (strcmp (buf+8, "din") == 0) CTX.out_link = LINK_DIN;
+                else CTX.out_link = LINK_USB;
+            }
+            else if (strncmp (buf, "presetswitch:",13) == 0) {
+                if (strcmp (buf+13, "beat") == 0) {
+                    CTX.preset_switch = SWITCH_BEAT;
+                }
+                else if (strcmp (buf+13, "now") == 0) {
+                    CTX.preset_switch = SWITCH_NOW;
+                }
+                else CTX.preset_switch = SWITCH_BAR;
+            }
         }
         fclose (pst);
     }
@@ -76,18 +149,45 @@ void context_init (void) {
 void context_write_global (void) {
     FILE *f = fopen ("/boot/tmglobal.new","w");
     if (! f) return;
-    fprintf (f, "inport:%s\n", CTX.portname_midi_in);
-    fprintf (f, "outport:%s\n", CTX.portname_midi_out);
-    fprintf (f, "triggertype:%i\n", (int) CTX.trigger_type);
+    fprintf (f, "inport:%s\n", CTX.portname_midi_in[0]);
+    fprintf (f, "outport:%s\n", CTX.portname_midi_out[0]);
+    for (int i=1; i<OUTPUT_PORTS; ++i) {
+        if (! CTX.portname_midi_out[i][0]) continue;
+        fprintf (f, "outport%i:%s\n", i+1, CTX.portname_midi_out[i]);
+    }
+    fprintf (f, "triggertype:%i\n", (int) CTX.trigger_type[0]);
+    fprintf (f, "inchannel:%i\n", CTX.in_channel[0]);
+    for (int i=1; i<INPUT_PORTS; ++i) {
+        if (! CTX.portname_midi_in[i][0]) continue;
+        fprintf (f, "inport%i:%s\n", i+1, CTX.portname_midi_in[i]);
+        fprintf (f, "triggertype%i:%i\n", i+1, (int) CTX.trigger_type[i]);
+        fprintf (f, "inchannel%i:%i\n", i+1, CTX.in_channel[i]);
+    }
+    for (int i=0; i<128; ++i) {
+        if (! CTX.custom_map[i]) continue;
+        fprintf (f, "map:%i:%i\n", i, CTX.custom_map[i]);
+    }
     fprintf (f, "sendchannel:%i\n", CTX.send_channel+1);
     fprintf (f, "extsync:%i\n", CTX.ext_sync);
+    fprintf (f, "clockout:%i\n", CTX.clock_out);
+    fprintf (f, "lookahead:%i\n", CTX.lookahead);
+    fprintf (f, "backend:%s\n",
+             (CTX.backend == BACKEND_PORTMIDI) ? "portmidi" : "alsa");
+    fprintf (f, "outlink:%s\n", (CTX.out_link == LINK_DIN) ? "din" : "usb");
+    fprintf (f, "presetswitch:%s\n",
+             (const char *[]){"bar","beat","now"}[CTX.preset_switch]);
     fclose (f);
     rename ("/boot/tmglobal.new","/boot/tmglobal.dat");
 }
 
+/** Load a preset of the current bank as the working preset, and queue
+  * it for the MIDI engine.
+  */
 void context_load_preset (int nr) {
-    if (nr<1 || nr>99) return;
-    memcpy (&CTX.preset, CTX.presets+nr, sizeof (preset));
+    if (nr<1 || nr>STORE_BANKPRESETS) return;
+    if (! store_read (CTX.bank_nr, nr, &CTX.preset)) {
+        context_default_preset (CTX.bank_nr, nr, &CTX.preset);
+    }
     CTX.preset_nr = nr;
     if (CTX.preset.name[0] == 0) {
         strcpy (CTX.preset.name, "Init");
@@ -98,19 +198,48 @@ void context_load_preset (int nr) {
             CTX.preset.triggers[i].slen = 8;
         }
     }
+    for (int i=0; i<12; ++i) {
+        steps_compile (CTX.steps + i, CTX.preset.triggers + i);
+    }
+    
+    /* The engine takes the new preset over at the next beat or bar, so
+       running sequences carry on without a gap. See midi_apply_preset() */
+    snapshot_queue (&CTX.preset, CTX.steps);
+}
+
+/** Compile the step table for a trigger of the working preset, and
+  * publish the result. Needs to be called after every change to the
+  * trigger's settings.
+  */
+void context_compile_trigger (int trig) {
+    steps_compile (CTX.steps + trig, CTX.preset.triggers + trig);
+    context_publish_preset();
+}
+
+/** Hand the working preset over to the MIDI engine, which only ever
+  * sees published snapshots of it. Cheap if nothing changed.
+  */
+void context_publish_preset (void) {
+    snapshot_publish (&CTX.preset, CTX.steps);
 }
 
 void context_store_preset (void) {
-    if (CTX.preset_nr < 1 || CTX.preset_nr > 99) return;
-    memcpy (CTX.presets + CTX.preset_nr, &CTX.preset, sizeof (preset));
-    FILE *pst = fopen ("/boot/tmpreset.new","w");
-    size_t res = fwrite (CTX.presets, sizeof(preset), 100, pst);
-    fclose (pst);
-    if (res == 100) rename ("/boot/tmpreset.new",
-                            "/boot/tmpreset.dat");
+    store_write (CTX.bank_nr, CTX.preset_nr, &CTX.preset);
+}
+
+/** Returns the name of a preset in the library, without loading it.
+  * Good until the next call.
+  */
+const char *context_preset_name (int bank, int nr) {
+    static preset p;
+    if (store_name (bank, nr, p.name)) return p.name;
+    context_default_preset (bank, nr, &p);
+    return p.name;
 }
 
 int daemon_main (int argc, const char *argv[]) {
+    signal (SIGUSR1, stats_request_dump);
+    thread_setup_process();
     context_init();
     lcd_init();
     button_manager_init();
@@ -0,0 +1,65 @@
+#include "match.h"
+#include <stddef.h>
+
+/** Trigger notes of the built-in controller types. The TR8 matches on
+  * exact notes, the others on the note within the octave.
+  */
+static const char match_tr8[12]     = {0x24,0x26,0x2b,0x2f,0x32,0x25,0x27,
+                                       0x2a,0x2e,0x31,0x33,0x34};
+static const char match_laser8[12]  = {0,2,4,5,6,7,9,11,1,3,8,10};
+static const char match_laser9[12]  = {0,1,2,4,5,6,7,9,11,3,8,10};
+static const char match_laser10[12] = {0,1,2,4,5,6,7,8,9,11,3,10};
+static const char match_chromatic[12] = {0,1,2,3,4,5,6,7,8,9,10,11};
+static const char match_pedals7[12] = {0,2,4,5,7,9,11,1,3,6,8,10};
+
+/** Compile the note lookup table for a trigger type.
+  * \param type The configured trigger type.
+  * \param custom For TYPE_CUSTOM, 128 entries holding the trigger
+  *               number plus one for each note, or 0 for none.
+  * \param channel Channel to listen to (1-16), or 0 for all channels.
+  */
+void match_compile (match_table *self, triggertype type,
+                    const char *custom, int channel) {
+    const char *notes = NULL;
+    
+    for (int i=0; i<128; ++i) self->trig[i] = -1;
+    self->chanmask = channel ? (1 << (channel-1)) : 0xffff;
+    
+    switch (type) {
+        case TYPE_ROLAND_TR8:
+            for (int i=11; i>=0; --i) self->trig[(int) match_tr8[i]] = i;
+            return;
+        
+        case TYPE_CUSTOM:
+            for (int i=0; i<128; ++i) {
+                if (custom[i] > 0 && custom[i] <= 12) {
+                    self->trig[i] = custom[i] - 1;
+                }
+            }
+            return;
+        
+        case TYPE_LASERHARP_8: notes = match_laser8; break;
+        case TYPE_LASERHARP_9: notes = match_laser9; break;
+        case TYPE_LASERHARP_10: notes = match_laser10; break;
+        case TYPE_CHROMATIC: notes = match_chromatic; break;
+        case TYPE_PEDALS_7: notes = match_pedals7; break;
+        default: return;
+    }
+    
+    for (int i=0; i<128; ++i) {
+        for (int t=0; t<12; ++t) {
+            if (notes[t] == i % 12) {
+                self->trig[i] = t;
+                break;
+            }
+        }
+    }
+}
+
+/** Convert a Note On/Off message to a matched trigger. Returns -1 if
+  * the note didn't match a trigger, or came in on the wrong channel.
+  */
+int match_lookup (const match_table *self, uint32_t msg) {
+    if (! (self->chanmask & (1 << (msg & 0x0f)))) return -1;
+    return self->trig[(msg >> 8) & 0x7f];
+}
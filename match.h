@@ -0,0 +1,22 @@
+#ifndef _MATCH_H
+#define _MATCH_H 1
+
+#include <stdint.h>
+#include "presets.h"
+
+/* =============================== TYPES =============================== */
+
+/** Compiled trigger matching for one controller setup. Maps every
+  * incoming note straight to a trigger.
+  */
+typedef struct match_table_s {
+    int8_t           trig[128]; /**< Trigger for each note, -1 for none */
+    uint16_t         chanmask; /**< Bit set for each channel we listen to */
+} match_table;
+
+/* ============================= FUNCTIONS ============================= */
+
+void         match_compile (match_table *, triggertype, const char *, int);
+int          match_lookup (const match_table *, uint32_t);
+
+#endif
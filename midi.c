@@ -2,6 +2,15 @@
 #include "presets.h"
 #include "thread.h"
 #include "btevent.h"
+#include "schedule.h"
+#include "ring.h"
+#include "shaper.h"
+#include "match.h"
+#include "extclock.h"
+#include "tempo.h"
+#include "stats.h"
+#include "voices.h"
+#include "snapshot.h"
 
 #include <stdlib.h>
 #include <stdio.h>
@@ -16,60 +25,338 @@ static bool initialized = false;
 typedef struct triggerstate_s {
     bool             gate; /**< True if key is down */
     uint64_t         ts; /**< time of noteon */
-    char             seqpos; /**< Current position in the sequence */
+    uint64_t         origin; /**< Beat position of the trigger (Q32.32) */
+    char             seqpos; /**< Next position in the step table */
+    char             playing; /**< Note sounding for the sequence, or 0 */
     uint64_t         looppos; /**< Number of steps since first trigger */
     char             velocity; /**< Recorded trigger velocity */
     char             gateperc; /**< Determined gate length% if applicable */
+    uint16_t         sent[128]; /**< Voice each note was last sent as */
 } triggerstate;
 
+/** Types of events on the sequencer schedule. Events that are due at
+  * the same time run in this order.
+  */
+typedef enum {
+    EV_PRESET_SWITCH, /**< Take over a newly loaded preset */
+    EV_CLOCK_TICK, /**< Send a MIDI clock tick */
+    EV_GATE_CLOSE, /**< Close the fixed-length gate of a SEND_NOTES trigger */
+    EV_SEQ_GATE, /**< Close the gate of the current sequencer note */
+    EV_SEQ_STEP /**< Play the next sequencer step */
+} midievent;
+
+/** Types of decoded input events */
+typedef enum {
+    IN_NOTEON, /**< Note On for a matched trigger */
+    IN_NOTEOFF, /**< Note Off for a matched trigger */
+    IN_CLOCK, /**< MIDI clock tick */
+    IN_START, /**< Start from the top of the song */
+    IN_CONTINUE, /**< Continue from the song position */
+    IN_STOP, /**< Stop */
+    IN_SONGPOS /**< Song Position Pointer */
+} inputtype;
+
+/** A decoded input event, as passed from the receive thread to the
+  * engine */
+typedef struct inputevent_s {
+    uint64_t         when; /**< Time of arrival */
+    uint64_t         matched; /**< Time the trigger was matched */
+    uint8_t          type; /**< Event type */
+    int8_t           trig; /**< Matched trigger */
+    uint8_t          velocity; /**< Note velocity */
+    uint16_t         value; /**< Song position in 16th notes */
+} inputevent;
+
+/** Number of slots in the input ring */
+#define INPUT_RING_SIZE 256
+
+/** Number of input events the engine handles in one go */
+#define INPUT_BATCH 32
+
+/** Number of slots in the output ring */
+#define OUTPUT_RING_SIZE 1024
+
+/** Number of output messages collected before handing them to the
+  * writer thread */
+#define OUTPUT_BATCH 256
+
+/** Smallest change of the external clock's quarter note the tempo
+  * follows, as a fraction (1/SYNC_RETEMPO) of the one in use. Smaller
+  * ones are jitter, and phase correction takes out the drift they
+  * leave. */
+#define SYNC_RETEMPO 1000
+
+/** State of an output port. The engine queues output for the port in
+  * its own batch and ring, and the writer thread drains every port on
+  * its own, so a port that fails doesn't hold up the others.
+  */
+typedef struct outport_s {
+    pthread_mutex_t  lock; /**< Lock on the port, writer side */
+    midi_port       *out; /**< Open port, NULL if none */
+    int              devid; /**< Backend device id, -1 if none */
+    bool             failed; /**< True if the last write failed */
+    char             devicename[256]; /**< Device name, empty if none */
+    midi_msg         batch[OUTPUT_BATCH]; /**< Output of the current tick */
+    int              batchsize; /**< Number of messages in the batch */
+    ring             output; /**< Output batches, engine to writer thread */
+    midi_msg         storage[OUTPUT_RING_SIZE]; /**< Ring storage */
+    shaper           shaper; /**< Bandwidth model of the output link */
+} outport;
+
+/** State of an input port. Each input matches triggers its own way,
+  * and they all feed the same engine.
+  */
+typedef struct inport_s {
+    midi_port       *in; /**< Open port, NULL if none */
+    char             devicename[256]; /**< Device name, empty if none */
+    match_table      matchtab[2]; /**< Compiled trigger matching */
+    match_table     *matcher; /**< Table in use by the receive thread */
+} inport;
+
 /** State of the MIDI system */
 static struct midistate {
     thread          *receive_thread; /**< MIDI receive loop */
-    thread          *send_thread; /**< MIDI send loop for gates/sequences */
+    thread          *send_thread; /**< Engine: input, gates, sequences */
+    thread          *write_thread; /**< Writes output to the device */
     bool             open; 
-    pthread_mutex_t  in_lock; /**< Lock on input stream */
-    pthread_mutex_t  out_lock; /**< Lock on output stream */
+    pthread_mutex_t  in_lock; /**< Lock on the input ports */
     pthread_mutex_t  seq_lock; /**< Lock on sequencer state */
-    PortMidiStream  *in; /**< MIDI input stream */
-    PortMidiStream  *out; /**< MIDI output stream */
-    char             in_devicename[256]; /**< Current MIDI device name */
-    char             out_devicename[256]; /**< Current MIDI device name */
-    int              current; /**< Currently active trigger */
+    const snapshot  *snap; /**< Preset snapshot read under seq_lock */
+    midi_backend    *backend; /**< MIDI backend in use */
+    inport           inputs[INPUT_PORTS]; /**< MIDI input ports */
+    outport          ports[OUTPUT_PORTS]; /**< MIDI output ports */
+    int              latency; /**< Output latency the ports were opened with */
+    uint64_t         outtime; /**< Delivery time for output, 0 for now */
+    uint64_t         horizon; /**< Latest delivery time handed to output */
+    uint64_t         cause; /**< Arrival time of the input being handled */
+    outprio          outprio; /**< Priority for notes being written */
+    int              current; /**< Most recently started sequence */
+    uint16_t         active; /**< Bit set for each running sequence */
     triggerstate     trig[12]; /**< State for all triggers */
-    bool             noteon[128]; /**< Note-on states of MIDI output */
+    voices           voices; /**< Sounding notes and their triggers */
+    uint16_t         released[VOICES_MAX]; /**< Voices just released */
+    uint8_t          notemaps[2][128]; /**< Output note maps */
+    uint8_t         *notemap; /**< Output note map in use */
     uint64_t         qnote; /**< Inferred quarter note value from extsync */
-    uint64_t         last_sync; /**< Last extsync point */
+    uint64_t         last_sync; /**< Last extsync beat */
+    tempo            tempo; /**< Maps beat positions to time */
+    extclock         extclock; /**< External clock follower */
+    bool             rephase; /**< Restart sequences on the next tick */
+    bool             switching; /**< A preset switch is on the schedule */
+    uint64_t         switchpos; /**< Beat position of the switch */
+    bool             clock_on; /**< True if we send MIDI clock */
+    bool             playing; /**< True if the transport is started */
+    bool             starting; /**< Send Start along with tick 0 */
+    uint64_t         clock_origin; /**< Beat position of tick 0 (Q32.32) */
+    int64_t          clock_count; /**< Ticks since tick 0 */
+    uint64_t         songpos; /**< Song position of the next tick */
+    sched_queue      schedule; /**< Pending gate and sequencer events */
+    conditional      wakeup; /**< Wakes up the engine thread */
+    bool             backlog; /**< Output left over in a batch */
+    uint32_t         outfull; /**< Flushes that found an output ring full */
+    uint32_t         outlost; /**< Output dropped on a full batch */
+    ring             input; /**< Decoded input, receive thread to engine */
+    inputevent       input_storage[INPUT_RING_SIZE]; /**< Ring storage */
+    conditional      outcond; /**< Wakes up the writer thread */
 } self;
 
-/** Return the current time in units of 0.1 milliseconds since epoch */
-uint64_t getclock (void) {
-    struct timespec ts;
-    clock_gettime (CLOCK_MONOTONIC_RAW, &ts);
-    return ((ts.tv_sec * 10000ULL) + (ts.tv_nsec / 100000ULL));
+/** Take self.seq_lock, and pin the preset snapshot the sequencer works
+  * from until midi_unlock(). The UI edits CTX.preset in place, so the
+  * engine never reads that, only the last snapshot published from it.
+  */
+static void midi_lock (void) {
+    pthread_mutex_lock (&self.seq_lock);
+    self.snap = snapshot_enter (SNAPSHOT_ENGINE);
 }
 
-/** Poll ALSA for an available MIDI port */
-bool midi_available (void) {
-    /* Don't use portmidi yet, or it will be bound to the non-working
-       situation */
+/** Let go of the preset snapshot and self.seq_lock */
+static void midi_unlock (void) {
+    self.snap = NULL;
+    snapshot_leave (SNAPSHOT_ENGINE);
+    pthread_mutex_unlock (&self.seq_lock);
+}
+
+/** Returns the tempo of the working preset in 1/100 BPM */
+static uint32_t midi_centibpm (void) {
+    const preset *P = &self.snap->preset;
+    if (P->tempo <= 0) return 12500;
+    return (uint32_t) P->tempo * 100 + P->tempo_frac;
+}
+
+/** Calculate the current quarter note length from tempo or ext sync */
+static uint64_t midi_qnote (void) {
+    return tempo_beat_ns (&self.tempo);
+}
+
+/** Calculate the length of a sequencer step for a trigger, as a beat
+  * position (Q32.32) */
+static uint64_t midi_seq_steplen (const triggerpreset *T) {
+    switch (T->slen) {
+        case 2: return TEMPO_BEAT * 2;
+        case 8: return TEMPO_BEAT / 2;
+        case 16: return TEMPO_BEAT / 4;
+    }
+    return TEMPO_BEAT;
+}
+
+/** Returns the time of the n-th step of a trigger's sequence, step 0
+  * being the trigger itself */
+static uint64_t midi_seq_steptime (int c, uint64_t n) {
+    uint64_t steplen = midi_seq_steplen (self.snap->preset.triggers + c);
+    return tempo_time (&self.tempo, self.trig[c].origin + steplen * n);
+}
+
+/** Calculate the gate length of a fixed-length SEND_NOTES trigger.
+  * Returns 0 if the gate is not controlled by time.
+  */
+static uint64_t midi_gate_notelen (const triggerpreset *T) {
+    uint64_t notelen = midi_qnote();
+    switch (T->nmode) {
+        case NMODE_FIXED_2: return notelen * 2;
+        case NMODE_FIXED_4: return notelen;
+        case NMODE_FIXED_8: return notelen / 2;
+        case NMODE_FIXED_16: return notelen / 4;
+        default: return 0;
+    }
+}
+
+/** Wake up the engine thread, so it can pick up a changed schedule or
+  * new input */
+static void midi_wakeup (void) {
+    conditional_signal (&self.wakeup);
+}
+
+/** Hand the output collected so far to the writer thread. Output that
+  * doesn't fit in a port's ring stays in its batch, and the engine comes
+  * back for it once the writer had a chance to catch up. Needs
+  * self.seq_lock, which also makes sure there is only one producer on
+  * the output rings at a time.
+  */
+static void midi_flush (void) {
+    uint64_t now = getclock();
+    bool any = false, backlog = false;
+    for (int p=0; p<OUTPUT_PORTS; ++p) {
+        outport *o = self.ports + p;
+        int i;
+        for (i=0; i<o->batchsize; ++i) {
+            o->batch[i].stamp = now;
+            if (! ring_push (&o->output, o->batch + i)) break;
+        }
+        if (i) any = true;
+        if (i < o->batchsize) {
+            memmove (o->batch, o->batch + i,
+                     (o->batchsize - i) * sizeof (midi_msg));
+            __atomic_add_fetch (&self.outfull, 1, __ATOMIC_RELAXED);
+            backlog = true;
+        }
+        o->batchsize -= i;
+    }
+    if (any) conditional_signal (&self.outcond);
+    if (backlog && ! self.backlog) midi_wakeup();
+    self.backlog = backlog;
+}
+
+/** Queue a short message for a MIDI output port. If the port was opened
+  * with a latency, the message is timestamped for delivery at
+  * self.outtime, so that the backend takes care of the exact timing.
+  * Note-ons get self.outprio, so the writer can tell the current
+  * sequencer step apart from other notes. The message is dropped if
+  * the writer is so far behind that the batch can't be handed over.
+  * Needs self.seq_lock.
+  */
+static void midi_write (int port, uint32_t msg) {
+    outport *o = self.ports + port;
+    if (! o->out) return;
+    if (o->batchsize == OUTPUT_BATCH) midi_flush();
+    if (o->batchsize == OUTPUT_BATCH) {
+        __atomic_add_fetch (&self.outlost, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    midi_msg *m = o->batch + o->batchsize++;
+    m->message = msg;
+    m->prio = shaper_prio (msg);
+    if (m->prio == PRIO_NOTE) m->prio = self.outprio;
+    m->when = self.outtime;
+    m->cause = self.cause;
+    if (m->when > self.horizon) self.horizon = m->when;
+}
+
+/** Queue a message for all output ports, for clock and transport.
+  * Needs self.seq_lock.
+  */
+static void midi_write_all (uint32_t msg) {
+    for (int p=0; p<OUTPUT_PORTS; ++p) midi_write (p, msg);
+}
+
+/** Returns the output port of a trigger */
+static int midi_trigger_port (const triggerpreset *T) {
+    return (T->port < OUTPUT_PORTS) ? T->port : 0;
+}
+
+/** Returns the output channel (0-15) of a trigger */
+static int midi_trigger_channel (const triggerpreset *T) {
+    return (T->channel >= 1 && T->channel <= 16) ? T->channel - 1
+                                                 : CTX.send_channel;
+}
+
+/** Returns the delivery time to use for messages that cancel output
+  * that may already have been handed to the driver ahead of time.
+  * Anything stamped at this point lands after all queued messages.
+  */
+static uint64_t midi_cancel_time (void) {
+    uint64_t now = getclock();
+    return (self.horizon > now) ? self.horizon : now;
+}
+
+/** Look-ahead window in getclock() units. Sequencer events are rendered
+  * this far ahead of their deadline.
+  */
+static uint64_t midi_lookahead (void) {
+    return (uint64_t) self.latency * CLOCK_MSEC;
+}
+
+/** Write a Note Off message for a voice. Needs self.seq_lock. */
+static void midi_write_noteoff (uint16_t id) {
+    midi_write (VOICE_PORT (id),
+                0x90 | VOICE_CHANNEL (id) | (VOICE_NOTE (id) << 8));
+}
+
+/** Have a trigger let go of a note. The Note Off goes out, on the
+  * channel and output note the note was sent as, once no other trigger
+  * holds it. Needs self.seq_lock.
+  */
+void midi_send_noteoff (int trig, char note) {
+    if (! note) return;
+    uint16_t id = self.trig[trig].sent[(int) note];
+    if (! voices_off (&self.voices, trig, id)) return;
+    midi_write_noteoff (id);
     
-    if (system ("/usr/bin/amidi -l | grep -q ^IO")) return false;
-    return true;
+#ifdef DEBUG_MIDI
+    printf ("NoteOff %i\n", note);
+#endif
 }
 
-/** Send a Note On message to the MIDI output */
-void midi_send_noteon (char note, char velocity) {
+/** Send a Note On message to the MIDI output on behalf of a trigger.
+  * A note that is already sounding is struck again; it keeps sounding
+  * until every trigger holding it has let go. Needs self.seq_lock.
+  */
+void midi_send_noteon (int trig, char note, char velocity) {
     if (! note) return;
-    char channel = CTX.send_channel;
-    long msg = 0x90 | channel | ((long) note << 8) | (long) velocity << 16;
-    pthread_mutex_lock (&self.out_lock);
+    const triggerpreset *T = self.snap->preset.triggers + trig;
+    uint8_t *map = __atomic_load_n (&self.notemap, __ATOMIC_ACQUIRE);
+    uint16_t id = VOICE_ID (midi_trigger_port (T), midi_trigger_channel (T),
+                            map[(int) note]);
     
-    /* Don't send double noteon messages */
-    if (! self.noteon[note]) {
-        self.noteon[note] = true;
-        Pm_WriteShort (self.out, 0, msg);
+    /* Let go of the note as sent before a transpose change */
+    uint16_t prev = self.trig[trig].sent[(int) note];
+    if (prev != id && voices_held (&self.voices, trig, prev)) {
+        midi_send_noteoff (trig, note);
     }
-    pthread_mutex_unlock (&self.out_lock);
+    
+    voices_on (&self.voices, trig, id);
+    self.trig[trig].sent[(int) note] = id;
+    midi_write (VOICE_PORT (id), 0x90 | VOICE_CHANNEL (id) |
+                (VOICE_NOTE (id) << 8) | ((uint32_t) velocity << 16));
     
 #ifdef DEBUG_MIDI
     printf ("NoteOn %i %i\n", note, velocity);
@@ -78,187 +365,300 @@ void midi_send_noteon (char note, char velocity) {
     button_manager_flash_midi_out();
 }
 
-/** Send a Note Off message to the MIDI output */
-void midi_send_noteoff (char note) {
-    if (! note) return;
-    char channel = CTX.send_channel;
-    long msg = 0x90 | channel | ((long) note << 8);
-    pthread_mutex_lock (&self.out_lock);
-    Pm_WriteShort (self.out, 0, msg);
-    self.noteon[note] = false;
-    pthread_mutex_unlock (&self.out_lock);
+/** Have a trigger let go of all the notes it holds. Needs
+  * self.seq_lock.
+  */
+static void midi_release_trigger (int trig) {
+    int count = voices_release (&self.voices, trig, self.released);
+    for (int i=0; i<count; ++i) midi_write_noteoff (self.released[i]);
+}
+
+/** Stop the transport. The clock keeps ticking, so downstream devices
+  * stay at our tempo. Needs self.seq_lock.
+  */
+static void midi_send_stop (void) {
+    self.starting = false;
+    if (! self.playing) return;
+    uint64_t outtime = self.outtime;
+    self.outtime = midi_cancel_time();
+    midi_write_all (0xfc);
+    self.outtime = outtime;
+    self.playing = false;
+}
+
+/** Send note off for the notes we know to be on, followed by an All
+  * Notes Off controller for anything else, on every channel a trigger
+  * sends on. Stamped to land after anything that was already rendered
+  * ahead. Needs self.seq_lock.
+  */
+static void midi_send_panic (void) {
+    uint16_t channels[OUTPUT_PORTS] = { 1 << CTX.send_channel };
+    for (int i=0; i<12; ++i) {
+        const triggerpreset *T = self.snap->preset.triggers + i;
+        channels[midi_trigger_port (T)] |= 1 << midi_trigger_channel (T);
+    }
     
-#ifdef DEBUG_MIDI
-    printf ("NoteOff %i\n", note);
-#endif
+    uint64_t outtime = self.outtime;
+    self.outtime = midi_cancel_time();
+    int count = voices_clear (&self.voices, self.released);
+    for (int i=0; i<count; ++i) midi_write_noteoff (self.released[i]);
+    for (int p=0; p<OUTPUT_PORTS; ++p) {
+        for (int c=0; c<16; ++c) {
+            if (channels[p] & (1 << c)) midi_write (p, 0xb0 | c | (123 << 8));
+        }
+    }
+    self.outtime = outtime;
 }
 
 /** Send a MIDI panic out */
 void midi_panic (void) {
-    for (char i=1; i<128; ++i) {
-        midi_send_noteoff (i);
-    }
+    midi_lock();
+    midi_send_stop();
+    midi_send_panic();
+    midi_flush();
+    midi_unlock();
 }
 
 /** Stop the sequencer from making noise */
 void midi_stop_sequencer (void) {
-    pthread_mutex_lock (&self.seq_lock);
-    if (self.current>=0) self.trig[self.current].ts = getclock() + 5000;
+    midi_lock();
+    sched_cancel (&self.schedule, EV_SEQ_STEP, -1);
+    sched_cancel (&self.schedule, EV_SEQ_GATE, -1);
     self.current = -1;
-    midi_panic();
-    pthread_mutex_unlock (&self.seq_lock);
+    self.active = 0;
+    midi_send_panic();
+    midi_flush();
+    midi_unlock();
 }
 
-/** Perform a sequencer step, then advance it to the next note.
+/** Perform a sequencer step, then advance it to the next step in the
+  * trigger's compiled step table.
   * \param ti The selected trigger
+  * \return false if a single shot sequence has run out of notes.
   */
-void midi_send_sequencer_step (int ti) {
-    triggerpreset *T = &CTX.preset.triggers[ti];
-
-    /* If we're set to single shot, bail out on the last note */
-    if (T->move == MOVE_SINGLE) {
-        if (self.trig[ti].looppos > T->lastnote) {
-            if (self.trig[ti].looppos == (T->lastnote+1)) {
-                midi_send_noteoff (T->notes[T->lastnote]);
-            }
-            self.trig[ti].looppos++;
-            return;
-        }
+bool midi_send_sequencer_step (int ti) {
+    const steptable *S = self.snap->steps + ti;
+    triggerstate *t = self.trig + ti;
+    int len = S->length;
+    
+    /* The previous step ends where this one starts */
+    if (t->playing) {
+        midi_send_noteoff (ti, t->playing);
+        t->playing = 0;
     }
-
-    /* The first step has no noteoff considerations */
-    if (self.trig[ti].looppos) {
-        char oldnote = T->notes[self.trig[ti].seqpos];
-        if (self.noteon[oldnote]) midi_send_noteoff (oldnote);
     
-#ifdef DEBUG_SEQUENCER
-        printf ("move %i ->", self.trig[ti].seqpos);
-#endif
+    /* If we're set to single shot, bail out after the last step */
+    if (len < 1 || (S->single && t->looppos >= (uint64_t) len)) {
+        t->looppos++;
+        return false;
+    }
+    
+    int pos = t->seqpos;
+    if (S->random) pos = rand() % len;
+    else if (pos >= len) pos = 0;
+    t->seqpos = (pos+1 < len) ? pos+1 : 0;
+    const seqstep *st = S->steps + pos;
     
-        switch (T->move) {
-            case MOVE_SINGLE:
-            case MOVE_LOOP_UP:
-                self.trig[ti].seqpos++;
-                break;
-        
-            case MOVE_LOOP_DOWN:
-                self.trig[ti].seqpos--;
-                break;
-        
-            case MOVE_LOOP_UPDOWN:
-                if (((self.trig[ti].looppos-1)/(T->lastnote?T->lastnote:1))&1) {
-                    self.trig[ti].seqpos--;
-                }
-                else self.trig[ti].seqpos++;
-                break;
-        
-            case MOVE_LOOP_STEPUP:
-                if (self.trig[ti].looppos % 3 == 2) {
-                    self.trig[ti].seqpos--;
-                }
-                else self.trig[ti].seqpos++;
-                break;
-        
-            case MOVE_LOOP_STEPDOWN:
-                if (self.trig[ti].looppos % 3 == 2) {
-                    self.trig[ti].seqpos++;
-                }
-                else self.trig[ti].seqpos--;
-                break;
-                
-            case MOVE_LOOP_RANDOM:
-                self.trig[ti].seqpos = rand() % (T->lastnote + 1);
-                break;
-        }
-        
-#ifdef DEBUG_SEQUENCER
-        printf ("%i ->", self.trig[ti].seqpos);
-#endif
-        
-        if ((self.trig[ti].seqpos < 0) ||
-            (self.trig[ti].seqpos == 255)) {
-            self.trig[ti].seqpos = T->lastnote;
-        }
-        else if (self.trig[ti].seqpos > T->lastnote) {
-            self.trig[ti].seqpos = 0;
-        }
-   
 #ifdef DEBUG_SEQUENCER
-       printf ("%i\n", self.trig[ti].seqpos);
+    printf ("step %i/%i note %i\n", pos, len, st->note);
 #endif
+    
+    char velocity = st->velocity;
+    if (st->flags & STEP_VELO_COPY) velocity = t->velocity;
+    else if (st->flags & STEP_VELO_RND_WIDE) velocity = (rand() % 126) + 1;
+    else if (st->flags & STEP_VELO_RND_NARROW) velocity = (rand() % 50) + 70;
+    
+    t->gateperc = st->gate;
+    if (st->flags & STEP_GATE_RND_WIDE) t->gateperc = 5 + (rand() % 90);
+    else if (st->flags & STEP_GATE_RND_NARROW) t->gateperc = 25 + (rand() % 50);
+    
+    t->looppos++;
+    if (st->note && (self.active & (1 << ti))) {
+        midi_send_noteon (ti, st->note, velocity);
+        t->playing = st->note;
     }
-    else {
-        switch (T->move) {
-            case MOVE_LOOP_DOWN:
-                self.trig[ti].seqpos = T->lastnote;
-                break;
+    return true;
+}
 
-            case MOVE_LOOP_RANDOM:
-                self.trig[ti].seqpos = rand() % (T->lastnote + 1);
-                break;
-        }                
+/** End a running sequence, with its notes stopping at the current
+  * output time. Needs self.seq_lock.
+  */
+static void midi_end_sequence (int ti) {
+    if (! (self.active & (1 << ti))) return;
+    midi_release_trigger (ti);
+    self.trig[ti].playing = 0;
+    sched_cancel (&self.schedule, EV_SEQ_STEP, ti);
+    sched_cancel (&self.schedule, EV_SEQ_GATE, ti);
+    self.active &= ~(1 << ti);
+    if (self.current == ti) self.current = -1;
+}
+
+/** Stop a running sequence, including its steps that may have been
+  * rendered ahead. Needs self.seq_lock.
+  */
+static void midi_stop_sequence (int ti) {
+    if (! (self.active & (1 << ti))) return;
+    uint64_t outtime = self.outtime;
+    self.outtime = midi_cancel_time();
+    midi_end_sequence (ti);
+    self.outtime = outtime;
+}
+
+/** Returns the beat position of clock tick n, counted from tick 0.
+  * Needs self.seq_lock.
+  */
+static uint64_t midi_clock_pos (int64_t n) {
+    uint64_t a = (uint64_t) ((n < 0) ? -n : n);
+    uint64_t offs = (a / EXTCLOCK_PPQ) * TEMPO_BEAT +
+                    ((a % EXTCLOCK_PPQ) * TEMPO_BEAT) / EXTCLOCK_PPQ;
+    return (n < 0) ? self.clock_origin - offs : self.clock_origin + offs;
+}
+
+/** Put the next clock tick on the schedule. Tick positions are worked
+  * out from tick 0, so rounding errors don't add up, and a tempo change
+  * only moves the tick that is pending. Needs self.seq_lock.
+  */
+static void midi_clock_schedule (void) {
+    uint64_t pos = midi_clock_pos (self.clock_count);
+    sched_push (&self.schedule, tempo_time (&self.tempo, pos),
+                EV_CLOCK_TICK, 0);
+}
+
+/** Start ticking from a new tick 0 at the given beat position. Needs
+  * self.seq_lock.
+  */
+static void midi_clock_anchor (uint64_t pos) {
+    sched_cancel (&self.schedule, EV_CLOCK_TICK, -1);
+    self.clock_origin = pos;
+    self.clock_count = 0;
+}
+
+/** Start or stop sending MIDI clock, depending on the settings. There
+  * is no clock output while we follow an external clock. Needs
+  * self.seq_lock.
+  */
+static void midi_clock_update (void) {
+    bool want = CTX.clock_out && ! CTX.ext_sync;
+    if (want == self.clock_on) return;
+    self.clock_on = want;
+    if (want) {
+        uint64_t when = getclock() + midi_lookahead();
+        midi_clock_anchor (tempo_pos (&self.tempo, when));
+        midi_clock_schedule();
+        return;
     }
-    
-    switch (T->sgate) {
-        case SGATE_RND_NARROW:
-            self.trig[ti].gateperc = 25 + (rand() % 50);
-            break;
-        
-        case SGATE_RND_WIDE:
-            self.trig[ti].gateperc = 5 + (rand() % 90);
-            break;
-            
-        default:
-            self.trig[ti].gateperc = (int) T->sgate;
-            break;
+    sched_cancel (&self.schedule, EV_CLOCK_TICK, -1);
+    midi_send_stop();
+}
+
+/** Send a clock tick, and schedule the next one. Tick 0 of a pending
+  * start goes out with a Start in front of it. Needs self.seq_lock.
+  */
+static void midi_clock_tick (void) {
+    if (self.starting && self.clock_count == 0) {
+        midi_write_all (0xfa);
+        self.starting = false;
+        self.playing = true;
+        self.songpos = 0;
     }
-    
-    self.trig[ti].looppos++;
-    int i = self.trig[ti].seqpos;
-    int ntcount = T->lastnote+1;
-    char velocity = 0;
-    
-    switch (T->vconf) {
-        case VELO_COPY:
-            velocity = self.trig[ti].velocity;
-            break;
-            
-        case VELO_INDIVIDUAL:
-            velocity = T->velocities[i];
-            break;
-        
-        case VELO_RND_WIDE:
-            velocity = (rand() % 126) + 1;
-            break;
-            
-        case VELO_RND_NARROW:
-            velocity = (rand() % 50) + 70;
-            break;
-        
-        case VELO_FIXED_64:
-            velocity = 64;
-            break;
-        
-        case VELO_FIXED_100:
-            velocity = 100;
-            break;
+    midi_write_all (0xf8);
+    if (self.playing) self.songpos++;
+    self.clock_count++;
+    midi_clock_schedule();
+}
+
+/** Start the transport, with tick 0 at the given beat position. The
+  * clock keeps running up to it: tick 0 moves to the start, and the
+  * ticks before it count up from below zero, so the only irregular
+  * interval is a slightly longer one right away. Needs self.seq_lock.
+  */
+static void midi_clock_start_at (uint64_t pos) {
+    if (! self.clock_on || self.playing || self.starting) return;
+    uint64_t next = midi_clock_pos (self.clock_count);
+    midi_clock_anchor (pos);
+    if (pos > next) {
+        uint64_t d = pos - next;
+        self.clock_count = -(int64_t) ((d / TEMPO_BEAT) * EXTCLOCK_PPQ +
+                            ((d % TEMPO_BEAT) * EXTCLOCK_PPQ) / TEMPO_BEAT);
     }
+    self.starting = true;
+    midi_clock_schedule();
+}
 
-    if (self.current == ti) midi_send_noteon (T->notes[i], velocity);
+/** Move the pending steps of running sequences, and the pending clock
+  * tick, to their times on the current tempo map. Needs self.seq_lock.
+  */
+static void midi_reschedule (void) {
+    for (int c=0; c<12; ++c) {
+        if (! (self.active & (1 << c))) continue;
+        sched_cancel (&self.schedule, EV_SEQ_STEP, c);
+        sched_push (&self.schedule,
+                    midi_seq_steptime (c, self.trig[c].looppos+1),
+                    EV_SEQ_STEP, c);
+    }
+    if (self.clock_on) {
+        sched_cancel (&self.schedule, EV_CLOCK_TICK, -1);
+        midi_clock_schedule();
+    }
+    if (self.switching) {
+        sched_cancel (&self.schedule, EV_PRESET_SWITCH, -1);
+        sched_push (&self.schedule, tempo_time (&self.tempo, self.switchpos),
+                    EV_PRESET_SWITCH, 0);
+    }
+}
+
+/** Follow a change of the preset tempo. The change takes effect at the
+  * end of the look-ahead window, as everything before it may already
+  * have been rendered at the old tempo. The beat position carries over,
+  * so sequences and the clock keep their phase. Needs self.seq_lock.
+  */
+static void midi_update_tempo (void) {
+    if (CTX.ext_sync && self.qnote) return;
+    uint32_t centibpm = midi_centibpm();
+    if (centibpm == self.tempo.centibpm) return;
+    tempo_set_bpm (&self.tempo, getclock() + midi_lookahead(), centibpm);
+    midi_reschedule();
+}
+
+/** Stop the transport of downstream devices */
+void midi_transport_stop (void) {
+    midi_lock();
+    midi_send_stop();
+    midi_flush();
+    midi_unlock();
+}
+
+/** Continue the transport of downstream devices from where it was
+  * stopped. The song position is rounded down to a 16th note, and sent
+  * ahead of the Continue.
+  */
+void midi_transport_continue (void) {
+    midi_lock();
+    if (self.clock_on && ! self.playing && ! self.starting) {
+        uint64_t spp = self.songpos / 6;
+        if (spp > 0x3fff) spp = 0;
+        self.songpos = spp * 6;
+        uint64_t outtime = self.outtime;
+        self.outtime = midi_cancel_time();
+        midi_write_all (0xf2 | ((spp & 0x7f) << 8) | ((spp >> 7) << 16));
+        midi_write_all (0xfb);
+        self.outtime = outtime;
+        self.playing = true;
+        midi_flush();
+    }
+    midi_unlock();
 }
 
 /** Respond to a Note Off event on the MIDI input. Only triggers that
   * are configured as SEND_NOTES with the mode set to NMODE_GATE will
   * need to respond to these. In other situations, the gate is
-  * controlled by the sequencer.
+  * controlled by the sequencer. Runs on the engine thread, with
+  * self.seq_lock held.
   */
 void midi_noteoff_response (int trig) {
-    triggerpreset *T = &CTX.preset.triggers[trig];
+    const triggerpreset *T = &self.snap->preset.triggers[trig];
     if (T->send == SEND_NOTES && T->nmode == NMODE_GATE) {
-        for (int i=0; i<=T->lastnote; ++i) {
-            char note = T->notes[i];
-            if (self.noteon[note]) midi_send_noteoff (note);
-        }
+        midi_release_trigger (trig);
         
 #ifdef DEBUG_MIDI
         printf ("gate\n");
@@ -270,68 +670,77 @@ void midi_noteoff_response (int trig) {
 
 /** Respond to a Note On event on the MIDI input. Either plays the
   * direct note or chords, or sets up the trigger state for the
-  * sequencer to pick up. */
+  * sequencer to pick up. Runs on the engine thread, with self.seq_lock
+  * held. */
 void midi_noteon_response (int trig, char velo) {
     int i;
-    triggerpreset *T = NULL;
+    const triggerpreset *T = NULL;
     
     /* mute any legato notes */
     for (i=0; i<12; ++i) {
-        T = &CTX.preset.triggers[i];
+        T = &self.snap->preset.triggers[i];
         if (T->send == SEND_NOTES && T->nmode == NMODE_LEGATO) {
             if (self.trig[i].gate) {
-                for (int n=0; n<=T->lastnote;++n) {
-                    midi_send_noteoff (T->notes[n]);
-                }
+                midi_release_trigger (i);
                 self.trig[i].gate = false;
             }
         }
     }
     
-    /* if the sequencer is already active, record its trigger time, so
-       we can quantize to the beat */
-    uint64_t last_ts = 0;
-    if (self.current >= 0) {
-        if (CTX.preset.triggers[self.current].send == SEND_SEQUENCE) {
-            last_ts = self.trig[self.current].ts;
-        }
+    /* if a sequence is already running, record its starting position,
+       so we can quantize to the beat */
+    bool follow = false;
+    uint64_t last_origin = 0;
+    if (self.current >= 0 && (self.active & (1 << self.current))) {
+        follow = true;
+        last_origin = self.trig[self.current].origin;
     }
 
-    T = &CTX.preset.triggers[trig];
+    T = &self.snap->preset.triggers[trig];
     
-    pthread_mutex_lock (&self.seq_lock);
-
     if (T->send == SEND_SEQUENCE) {
-        /* Cancel current gig */
-        if (self.current >= 0) {
-            char nt = CTX.preset.triggers[self.current]
-                                .notes[self.trig[self.current].seqpos];
-            if (self.noteon[nt]) midi_send_noteoff (nt);
+        if (self.snap->preset.seqmode == SEQMODE_LAYERED) {
+            /* Layered sequences run side by side, triggering a running
+               one again stops it */
+            if (self.active & (1 << trig)) {
+                midi_stop_sequence (trig);
+                return;
+            }
         }
+        else {
+            /* Cancel the current gig */
+            for (i=0; i<12; ++i) midi_stop_sequence (i);
+        }
+        self.active |= (1 << trig);
         self.current = trig;
     }
     self.trig[trig].ts = getclock();
+    self.trig[trig].origin = tempo_pos (&self.tempo, self.trig[trig].ts);
     self.trig[trig].gate = true;
     self.trig[trig].velocity = velo;
     self.trig[trig].seqpos = self.trig[trig].looppos = 0;
     
     /* Quantize a jump from one sequence into another */
-    if (last_ts && T->send == SEND_SEQUENCE) {
-        uint64_t qnote = 600000 / CTX.preset.tempo;
-        if (CTX.ext_sync) qnote = self.qnote;
-        
-        uint64_t tsdif = self.trig[trig].ts - last_ts;
-        tsdif = (tsdif/qnote);
-        tsdif *= qnote;
+    if (follow && T->send == SEND_SEQUENCE &&
+        self.trig[trig].origin > last_origin) {
+        uint64_t beats = (self.trig[trig].origin - last_origin) / TEMPO_BEAT;
 
 #ifdef DEBUG_MIDI        
-        printf ("quantizing %llx\n", tsdif);
+        printf ("quantizing %llu beats\n", beats);
 #endif        
         
-        self.trig[trig].ts = last_ts + tsdif;
+        self.trig[trig].origin = last_origin + beats * TEMPO_BEAT;
     }
     
-    pthread_mutex_unlock (&self.seq_lock);
+    /* The first step of a sequence is due one step after the
+       (quantized) trigger position. Downstream devices get started
+       along with it. */
+    if (T->send == SEND_SEQUENCE) {
+        uint64_t first = self.trig[trig].origin + midi_seq_steplen (T);
+        midi_clock_start_at (first);
+        sched_push (&self.schedule, tempo_time (&self.tempo, first),
+                    EV_SEQ_STEP, trig);
+    }
 
     /* If it's not a sequence trigger, perform note operations on all
        notes in the trigger */
@@ -366,322 +775,864 @@ void midi_noteon_response (int trig, char velo) {
                     break;
             }
             
-            midi_send_noteon (T->notes[i], velocity);
+            midi_send_noteon (trig, T->notes[i], velocity);
             self.trig[trig].ts = getclock();
         }
+        
+        /* Schedule the end of a fixed-length gate */
+        sched_cancel (&self.schedule, EV_GATE_CLOSE, trig);
+        uint64_t notelen = midi_gate_notelen (T);
+        if (notelen) {
+            sched_push (&self.schedule, self.trig[trig].ts + notelen,
+                        EV_GATE_CLOSE, trig);
+        }
     }
 }
 
-char match_tr8[12]      = {0x24,0x26,0x2b,0x2f,0x32,0x25,0x27,0x2a,
-                           0x2e,0x31,0x33,0x34};
-char match_laser8[12]   = {0,2,4,5,6,7,9,11,1,3,8,10};
-char match_laser9[12]   = {0,1,2,4,5,6,7,9,11,3,8,10};
-char match_laser10[12]  = {0,1,2,4,5,6,7,8,9,11,3,10};
-char match_pedals7[12]  = {0,2,4,5,7,9,11,1,3,6,8,10};
+/** Put input read from several ports back in the order it arrived in.
+  * The input of each port is in order already, and there are only a
+  * few ports, so an insertion sort that keeps equal times in the order
+  * they were read does it.
+  */
+static void midi_merge_input (midi_msg *msgs, int count) {
+    for (int i=1; i<count; ++i) {
+        midi_msg m = msgs[i];
+        int j = i;
+        while (j > 0 && msgs[j-1].when > m.when) {
+            msgs[j] = msgs[j-1];
+            j--;
+        }
+        msgs[j] = m;
+    }
+}
 
-/** Convert a MIDI note number to a matched trigger, as configured in
-  * the system settings. Returns -1 if the note didn't match a trigger.
+/** Wait for input on the incoming MIDI ports. Decodes Note On/Off,
+  * clock and transport messages, and passes them on to the engine
+  * through the input ring, in the order they arrived in. Notes are
+  * matched to triggers by the settings of the port they came in on.
+  * Never waits for the engine.
+  * \param timeout_ms How long to wait for input.
+  * \return The number of events passed on, -1 if there is no input.
   */
-int midi_match_trigger (char note) {
-    char in_note = note;
-    if (CTX.trigger_type != TYPE_ROLAND_TR8) in_note = note % 12;
-    for (int i=0; i<12; ++i) {
-        char match_note;
-        switch (CTX.trigger_type) {
-            case TYPE_ROLAND_TR8:
-                match_note = match_tr8[i];
-                break;
-            
-            case TYPE_LASERHARP_8:
-                match_note = match_laser8[i];
-                break;
+int midi_input_tick (int timeout_ms) {
+    midi_msg buffer[128];
+    midi_port *ports[INPUT_PORTS];
+    int index[INPUT_PORTS];
+    int nports = 0;
+    int count;
+    
+    pthread_mutex_lock (&self.in_lock);
+    for (int p=0; p<INPUT_PORTS; ++p) {
+        if (! self.inputs[p].in) continue;
+        ports[nports] = self.inputs[p].in;
+        index[nports++] = p;
+    }
+    if (! nports) {
+        pthread_mutex_unlock (&self.in_lock);
+        return -1;
+    }
+    
+    count = 0;
+    if (self.backend->wait (ports, nports, timeout_ms) > 0) {
+        count = self.backend->read (ports, nports, buffer, 128);
+    }
+    pthread_mutex_unlock (&self.in_lock);
+    if (nports > 1) midi_merge_input (buffer, count);
+    
+    int pushed = 0;
+    for (int i=0; i<count; ++i) {
+        uint32_t msg = buffer[i].message;
+        inputevent ev = { .when = buffer[i].when };
+        
+        /* Note On / Off? */
+        if ((msg & 0xe0) == 0x80) {
+            char vel = ((msg & 0x7f0000) >> 16);
             
-            case TYPE_LASERHARP_9:
-                match_note = match_laser9[i];
-                break;
+            /* Note On with velocity 0 is effectively
+               note off */
+            ev.type = IN_NOTEOFF;
+            if ((msg & 0xf0) == 0x90 && vel) ev.type = IN_NOTEON;
+            ev.velocity = vel;
+            inport *src = self.inputs + index[buffer[i].source];
+            const match_table *matcher = __atomic_load_n (&src->matcher,
+                                                          __ATOMIC_ACQUIRE);
+            ev.trig = match_lookup (matcher, msg);
+            button_manager_flash_midi_in();
+            if (ev.trig < 0) continue;
+            ev.matched = getclock();
+            stats_record (STAT_MATCH, ev.matched - ev.when);
+        }
+        else if (msg == 0xf8) {
+            ev.type = IN_CLOCK;
+        }
+        else if (msg == 0xfa) ev.type = IN_START;
+        else if (msg == 0xfb) ev.type = IN_CONTINUE;
+        else if (msg == 0xfc) ev.type = IN_STOP;
+        else if ((msg & 0xff) == 0xf2) {
+            ev.type = IN_SONGPOS;
+            ev.value = ((msg >> 8) & 0x7f) | ((msg >> 9) & 0x3f80);
+        }
+        else continue;
+        
+        if (ring_push (&self.input, &ev)) pushed++;
+    }
+    if (pushed) midi_wakeup();
+    return pushed;
+}
 
-            case TYPE_LASERHARP_10:
-                match_note = match_laser10[i];
-                break;
+/** Thread that waits on the incoming MIDI ports. The timeout keeps
+  * device changes from waiting on us for long. */
+void midi_receive_thread (thread *t) {
+    while (1) {
+        if (midi_input_tick (100) < 0) sleep (1);
+    }
+}
 
-            case TYPE_CHROMATIC:
-                match_note = i;
-                break;
+/** Restart all running sequences, with their first step at the given
+  * time. Used when the external clock is started.
+  */
+static void midi_rephase_sequences (uint64_t when) {
+    uint64_t pos = tempo_pos (&self.tempo, when);
+    for (int c=0; c<12; ++c) {
+        if (! (self.active & (1 << c))) continue;
+        uint64_t steplen = midi_seq_steplen (self.snap->preset.triggers + c);
+        sched_cancel (&self.schedule, EV_SEQ_STEP, c);
+        self.trig[c].origin = pos - steplen;
+        self.trig[c].seqpos = self.trig[c].looppos = 0;
+        sched_push (&self.schedule, when, EV_SEQ_STEP, c);
+    }
+}
 
-            case TYPE_PEDALS_7:
-                match_note = match_pedals7[i];
-                break;
-        }
-        if (match_note == in_note) return i;
+/** Handle transport messages from the external clock. Start and Song
+  * Position Pointer tell the follower where the beat is, Stop silences
+  * the sequencer.
+  */
+static void midi_handle_transport (inputevent *ev) {
+    if (! CTX.ext_sync) return;
+    switch (ev->type) {
+        case IN_START:
+            extclock_position (&self.extclock, 0);
+            self.rephase = true;
+            break;
+        
+        case IN_SONGPOS:
+            extclock_position (&self.extclock, (uint64_t) ev->value * 6);
+            break;
+        
+        case IN_STOP:
+            for (int c=0; c<12; ++c) midi_stop_sequence (c);
+            self.rephase = false;
+            break;
     }
-    return -1;
 }
 
-/** Thread that polls the incoming MIDI port, dispatching Note On and
-  * Off messages further into the system */
-void midi_receive_thread (thread *t) {
-    /* TR-8
-    char trigmatch[12] = {0x24,0x26,0x2b,0x2f,0x32,0x25,0x27,0x2a,
-                          0x2e,0x31,0x33,0x34}; */
+/** Handle a MIDI clock tick. The follower filters the tick times, once
+  * it has locked on, its tempo and beat position drive the sequencer.
+  */
+static void midi_handle_clock (uint64_t when) {
+    bool was_locked = self.extclock.locked;
+    extclock_tick (&self.extclock, when);
+    if (self.rephase) {
+        midi_rephase_sequences (when);
+        self.rephase = false;
+    }
     
+    if (! self.extclock.locked) {
+        /* Keep the last known tempo until we have locked again */
+        if (was_locked) CTX.ext_tempo = 0;
+        return;
+    }
     
-    char trigmatch[12] = {48,49,50,52,53,54,55,57,59,51,56,58};
-                          
-    PmEvent buffer[128];
-    uint64_t last_sync = 0;
-    uint64_t current_sync = 0;
-    uint64_t sync_count = 0;
+    uint64_t qn = extclock_qnote (&self.extclock);
+    if (qn < 5 * CLOCK_MSEC) return;
+    self.qnote = qn;
+    self.last_sync = extclock_beat (&self.extclock);
+    CTX.ext_tempo = (int) ((60 * CLOCK_SEC + (qn/2)) / qn);
+    /* Only follow it when asked to, the preset tempo rules otherwise.
+       Like any tempo change, it takes effect past what was rendered
+       already */
+    uint64_t cur = midi_qnote();
+    uint64_t diff = (qn > cur) ? qn - cur : cur - qn;
+    if (CTX.ext_sync && diff > cur / SYNC_RETEMPO) {
+        tempo_set_period (&self.tempo, getclock() + midi_lookahead(), qn);
+        midi_reschedule();
+    }
     
-    int count;
-    while (1) {
-        pthread_mutex_lock (&self.in_lock);
-        if (self.in) {
-            if (Pm_Poll (self.in) == TRUE) {
-                count = Pm_Read (self.in, buffer, 128);
-                if (count) {
-                    for (int i=0; i<count; ++i) {
-                        long msg = buffer[i].message;
-                        
-                        /* Note On / Off? */
-                        if ((msg & 0xe0) == 0x80) {
-                            bool noteon = false;
-                            char note = ((msg & 0x7f00) >> 8);
-                            char vel = ((msg & 0x7f0000) >> 16);
-                            
-                            /* Note On with velocity 0 is effectively
-                               note off */
-                            if ((msg & 0xf0) == 0x90 && vel) {
-                                noteon = true;
-                            }
-                        
-                            int n = midi_match_trigger (note);
-                            if (n>=0) {
-                                if (noteon) midi_noteon_response (n, vel);
-                                else midi_noteoff_response (n);
-                            }
-                            button_manager_flash_midi_in();
-                        }
-                        else if (msg == 0xf8) {
-                            /* Save up to 4 quarter notes before making
-                               a decision. Spreads out the errors in
-                               overall timing */
-                            if (! (sync_count % 96)) {
-                                last_sync = current_sync;
-                                
-                                /* Assume we spent some time */
-                                current_sync = getclock() -24;
-                                if (last_sync) {
-                                    /* Calculate desired quarter note len */
-                                    uint64_t qn = (current_sync-last_sync)/4;
-                                    if (qn > 50) {
-                                        self.qnote = qn;
-                                        self.last_sync = current_sync;
-                                        CTX.ext_tempo = ((600000+(qn/2))/qn);
-
 #ifdef DEBUG_MIDI
-                                        printf ("qnote=%llx\n", qn);
-                                        printf ("ext=%i\n", CTX.ext_tempo);
+    if (! was_locked) {
+        printf ("locked qnote=%llu jitter=%ius\n", qn,
+                extclock_jitter_us (&self.extclock));
+    }
 #endif
-                                    }
-                                }
-                            }
-                            sync_count++;
-                        }
-                    }
-                }
-                pthread_mutex_unlock (&self.in_lock);
+}
+
+/** Report on the external clock.
+  * \param jitter_us Receives the estimated jitter in microseconds.
+  * \return true if the follower is locked to a running clock.
+  */
+bool midi_sync_status (int *jitter_us) {
+    if (! initialized) return false;
+    midi_lock();
+    bool res = extclock_running (&self.extclock, getclock());
+    if (jitter_us) *jitter_us = extclock_jitter_us (&self.extclock);
+    midi_unlock();
+    return res;
+}
+
+/** Drain the input ring in batches, and respond to everything in it.
+  * Needs self.seq_lock.
+  */
+static void midi_run_input (void) {
+    inputevent batch[INPUT_BATCH];
+    int count;
+    while ((count = ring_pop (&self.input, batch, INPUT_BATCH))) {
+        uint64_t now = getclock();
+        for (int i=0; i<count; ++i) {
+            switch (batch[i].type) {
+                case IN_NOTEON:
+                    stats_record (STAT_QUEUE, now - batch[i].matched);
+                    self.cause = batch[i].when;
+                    midi_noteon_response (batch[i].trig, batch[i].velocity);
+                    self.cause = 0;
+                    break;
+                
+                case IN_NOTEOFF:
+                    stats_record (STAT_QUEUE, now - batch[i].matched);
+                    self.cause = batch[i].when;
+                    midi_noteoff_response (batch[i].trig);
+                    self.cause = 0;
+                    break;
+                
+                case IN_CLOCK:
+                    midi_handle_clock (batch[i].when);
+                    break;
+                
+                case IN_START:
+                case IN_CONTINUE:
+                case IN_STOP:
+                case IN_SONGPOS:
+                    midi_handle_transport (batch + i);
+                    break;
+            }
+        }
+    }
+}
+
+/** If external syncing is enabled, shift the sequence of a trigger
+  * forwards or backwards to meet the beat of the external clock, as
+  * filtered by the follower. The phase error is worked out in closed
+  * form, and half of it is taken out per step.
+  */
+static void midi_sync_sequencer (int c, uint64_t steplen) {
+    if (! CTX.ext_sync || ! self.last_sync) return;
+    uint64_t beat = tempo_pos (&self.tempo, self.last_sync);
+    if (beat <= self.trig[c].origin) return;
+    
+    /* Steps longer than a beat still line up with the beat */
+    uint64_t grid = (steplen < TEMPO_BEAT) ? steplen : TEMPO_BEAT;
+    
+    /* Distance from the closest grid point before the sync point */
+    uint64_t offs = (beat - self.trig[c].origin) % grid;
+    uint64_t err = (offs < grid/2) ? offs : grid-offs;
+    stats_record (STAT_SYNC, (err * midi_qnote()) >> 32);
+    if (offs < grid/2) { /* we're early */
+        self.trig[c].origin += (offs+1)/2;
+    }
+    else { /* late */
+        self.trig[c].origin -= (grid-offs+1)/2;
+    }
+}
+
+/** Handle a sequencer step coming due. Plays the step, then puts
+  * the gate close and the next step on the schedule.
+  */
+static void midi_run_sequencer (int c) {
+    const triggerpreset *T = self.snap->preset.triggers + c;
+    if (! (self.active & (1 << c)) || T->send != SEND_SEQUENCE) return;
+    
+    uint64_t steplen = midi_seq_steplen (T);
+    midi_sync_sequencer (c, steplen);
+    
+    self.outprio = PRIO_STEP;
+    bool played = midi_send_sequencer_step (c);
+    self.outprio = PRIO_NOTE;
+    
+    if (played) {
+        /* looppos has already moved on, so this is the current step */
+        uint64_t steppos = self.trig[c].origin + steplen*self.trig[c].looppos;
+        
+        /* A 100% gate gets closed by the next step */
+        if (self.trig[c].gateperc < 100) {
+            steppos += (steplen*self.trig[c].gateperc)/100ULL;
+            sched_push (&self.schedule, tempo_time (&self.tempo, steppos),
+                        EV_SEQ_GATE, c);
+        }
+    }
+    else if (self.trig[c].looppos >
+             (uint64_t) self.snap->steps[c].length) {
+        /* Single shot is done */
+        self.active &= ~(1 << c);
+        return;
+    }
+    
+    sched_push (&self.schedule,
+                midi_seq_steptime (c, self.trig[c].looppos+1),
+                EV_SEQ_STEP, c);
+}
+
+/** Returns the beat position a loaded preset takes over at: the next
+  * beat or bar of the running clock or sequence at or after a given
+  * position, or that position itself if nothing keeps time. Needs
+  * self.seq_lock.
+  */
+static uint64_t midi_switch_pos (uint64_t earliest) {
+    if (CTX.preset_switch == SWITCH_NOW) return earliest;
+    uint64_t ref;
+    if (self.clock_on && (self.playing || self.starting)) {
+        ref = self.clock_origin;
+    }
+    else if (self.current >= 0 && (self.active & (1 << self.current))) {
+        ref = self.trig[self.current].origin;
+    }
+    else if (self.active) {
+        ref = self.trig[__builtin_ctz (self.active)].origin;
+    }
+    else return earliest;
+    
+    uint64_t q = (CTX.preset_switch == SWITCH_BAR) ? 4*TEMPO_BEAT
+                                                   : TEMPO_BEAT;
+    if (earliest <= ref) return ref;
+    return ref + ((earliest - ref + q - 1) / q) * q;
+}
+
+/** Put a switch to a newly loaded preset on the schedule, if there is
+  * one waiting. It can't come before the end of the look-ahead window,
+  * as everything up to there may have been rendered already. Needs
+  * self.seq_lock.
+  */
+static void midi_schedule_switch (void) {
+    if (self.switching || ! snapshot_pending()) return;
+    uint64_t earliest = tempo_pos (&self.tempo, getclock() + midi_lookahead());
+    self.switchpos = midi_switch_pos (earliest);
+    self.switching = true;
+    sched_push (&self.schedule, tempo_time (&self.tempo, self.switchpos),
+                EV_PRESET_SWITCH, 0);
+}
+
+/** Take over the preset that was loaded, at the current output time.
+  * Sequences that the new preset still has carry on in phase, on the
+  * grid of their new step length, from the step of the new pattern
+  * they would have reached had it been running all along. Only notes
+  * the new preset has no way to end get stopped: sequences it doesn't
+  * have, and held chords it would release differently. Needs
+  * self.seq_lock.
+  */
+static void midi_switch_preset (void) {
+    self.switching = false;
+    const snapshot *old = self.snap;
+    const snapshot *next = snapshot_take();
+    if (! next) return;
+    self.snap = next;
+    
+    for (int c=0; c<12; ++c) {
+        const triggerpreset *O = old->preset.triggers + c;
+        const triggerpreset *N = next->preset.triggers + c;
+        triggerstate *t = self.trig + c;
+        if (self.active & (1 << c)) {
+            if (N->send != SEND_SEQUENCE ||
+                (next->preset.seqmode == SEQMODE_SINGLE &&
+                 c != self.current)) {
+                midi_end_sequence (c);
+                continue;
             }
-            else {
-                pthread_mutex_unlock (&self.in_lock);
-                musleep (5000);
+            uint64_t steplen = midi_seq_steplen (N);
+            uint64_t k = 1;
+            if (self.switchpos > t->origin) {
+                k = (self.switchpos - t->origin + steplen - 1) / steplen;
             }
+            if (k < 1) k = 1;
+            int len = next->steps[c].length;
+            t->looppos = k-1;
+            t->seqpos = len ? (int) ((k-1) % len) : 0;
         }
-        else {
-            pthread_mutex_unlock (&self.in_lock);
-            sleep (1);
+        else if (t->gate && O->send == SEND_NOTES &&
+                 (N->send != SEND_NOTES || N->nmode != O->nmode)) {
+            midi_release_trigger (c);
+            t->gate = false;
+            sched_cancel (&self.schedule, EV_GATE_CLOSE, c);
         }
     }
+    
+    /* The new tempo starts at the switch, which also puts the pending
+       steps on their new grid */
+    uint32_t centibpm = midi_centibpm();
+    if (! (CTX.ext_sync && self.qnote) && centibpm != self.tempo.centibpm) {
+        tempo_set_bpm (&self.tempo, self.outtime, centibpm);
+    }
+    midi_reschedule();
 }
 
-/** Thread that handles the programmed gate and sequencer. */
-void midi_send_thread (thread *t) {
-    while (1) {
-        /* Calculate quarter note length from tempo or ext sync */
-        uint64_t qnote = 600000 / CTX.preset.tempo;
-        if (CTX.ext_sync) qnote = self.qnote;
-        uint64_t now = getclock();
-        int c = 0;
+/** Handle a single event off the schedule */
+static void midi_handle_event (sched_event *ev) {
+    int c = ev->trig;
+    const triggerpreset *T = self.snap->preset.triggers + c;
+    
+    switch (ev->type) {
+        case EV_GATE_CLOSE:
+            if (T->send == SEND_NOTES && self.trig[c].gate) {
+                midi_release_trigger (c);
+                self.trig[c].gate = false;
+            }
+            break;
         
-        /* Go over all triggers to close any overdue gates */
-        for (c=0; c<12; ++c) {
-            triggerpreset *T = CTX.preset.triggers + c;
-            uint64_t dif = now - self.trig[c].ts;
-            if (now < self.trig[c].ts) continue;
-            
-            /* Only consider SEND_NOTES that has a defined gate length */
-            if ((T->send == SEND_NOTES) && (T->nmode != NMODE_GATE) &&
-                (T->nmode != NMODE_LEGATO)) {
-                if (self.trig[c].gate) {
-                    uint64_t notelen = qnote;
-                    switch (T->nmode) {
-                        case NMODE_FIXED_2:
-                            notelen *= 2;
-                            break;
-                        
-                        case NMODE_FIXED_8:
-                            notelen /= 2;
-                            break;
-                        
-                        case NMODE_FIXED_16:
-                            notelen /= 4;
-                            break;
-                    }
-                    if (dif >= notelen) {
-                        for (int i=0; i<=T->lastnote; ++i) {
-                            if (self.noteon[T->notes[i]]) {
-                                midi_send_noteoff (T->notes[i]);
-                            }
-                        }
-                        self.trig[c].gate = false;
-                    }
-                }
+        case EV_SEQ_GATE:
+            if ((self.active & (1 << c)) && self.trig[c].playing) {
+                midi_send_noteoff (c, self.trig[c].playing);
+                self.trig[c].playing = 0;
             }
+            break;
+        
+        case EV_SEQ_STEP:
+            midi_run_sequencer (c);
+            break;
+        
+        case EV_CLOCK_TICK:
+            midi_clock_tick();
+            break;
+        
+        case EV_PRESET_SWITCH:
+            midi_switch_preset();
+            break;
+    }
+}
+
+/** Run all scheduled events that are due. Events inside the look-ahead
+  * window are rendered early, and sent out timestamped with their
+  * deadline.
+  * \param now The current time.
+  * \return The deadline of the next pending event, 0 if there is none.
+  */
+uint64_t midi_run_schedule (uint64_t now) {
+    sched_event ev;
+    while (sched_pop_due (&self.schedule, now + midi_lookahead(), &ev)) {
+        self.outtime = ev.when;
+        midi_handle_event (&ev);
+    }
+    self.outtime = 0;
+    return sched_next (&self.schedule);
+}
+
+/** Run the engine once. Handles input passed on by the receive thread,
+  * and whatever is due of the programmed gate and sequencer, and hands
+  * the output to the writer, coming back a millisecond later for any
+  * the writer had no room for.
+  * \return The time the engine has to run again, 0 if it has nothing to
+  *         do until there is new input or a change to the schedule.
+  */
+uint64_t midi_engine_tick (void) {
+    midi_lock();
+    midi_update_tempo();
+    midi_run_input();
+    midi_schedule_switch();
+    uint64_t next = midi_run_schedule (getclock());
+    midi_flush();
+    if (next) {
+        uint64_t ahead = midi_lookahead();
+        next = (next > ahead) ? next - ahead : 1;
+    }
+    if (self.backlog) {
+        uint64_t retry = getclock() + CLOCK_MSEC;
+        if (! next || retry < next) next = retry;
+    }
+    midi_unlock();
+    return next;
+}
+
+/** Engine thread. Sleeps until the next deadline on the schedule, or
+  * until woken up by new input or a change to the schedule.
+  */
+void midi_send_thread (thread *t) {
+    while (1) {
+        uint64_t next = midi_engine_tick();
+        if (next) {
+            struct timespec until = {
+                .tv_sec = (time_t) (next / CLOCK_SEC),
+                .tv_nsec = (long) (next % CLOCK_SEC)
+            };
+            conditional_wait_until (&self.wakeup, &until);
+        }
+        else conditional_wait (&self.wakeup);
+    }
+}
+
+/** Record the latencies of output that was just written, and how late
+  * sequencer steps and timed note-offs were handed over, if at all.
+  * Output with a timestamp in the future is late only if its deadline
+  * passed before it was written.
+  */
+static void midi_record_output (const midi_msg *msgs, int count) {
+    uint64_t now = getclock();
+    for (int i=0; i<count; ++i) {
+        const midi_msg *m = msgs + i;
+        stats_record (STAT_WRITE, now - m->stamp);
+        if (m->cause) stats_record (STAT_INOUT, now - m->cause);
+        if (! m->when) continue;
+        uint64_t late = (now > m->when) ? now - m->when : 0;
+        if (m->prio == PRIO_STEP) stats_record (STAT_STEP, late);
+        else if (m->prio == PRIO_NOTEOFF && (m->message & 0xf0) != 0xb0) {
+            stats_record (STAT_GATE, late);
         }
+    }
+}
+
+/** Write output to a port. Everything the engine produced since the
+  * last round passes through the shaper, and what it lets through goes
+  * out in a single backend write, so chords and panics leave as one
+  * burst. Output for a port that failed is dropped until the port gets
+  * reopened, so it doesn't pile up.
+  * \return The time to come back for messages the shaper held back
+  *         because the link is saturated, 0 if there are none.
+  */
+static uint64_t midi_output_port (outport *o) {
+    midi_msg batch[OUTPUT_BATCH];
+    pthread_mutex_lock (&o->lock);
+    do {
+        if (! o->out || o->failed) {
+            while (ring_pop (&o->output, batch, OUTPUT_BATCH));
+            shaper_init (&o->shaper, o->shaper.rate);
+            break;
+        }
+        int room = SHAPER_MAX - o->shaper.npending;
+        if (room > OUTPUT_BATCH) room = OUTPUT_BATCH;
+        int count = ring_pop (&o->output, batch, room);
+        shaper_add (&o->shaper, batch, count);
         
-        /* Check for an active sequencer */
-        c = self.current;
-        if (c>=0) {
-            triggerpreset *T = CTX.preset.triggers + c;
-            if (now < self.trig[c].ts) {
-                continue; 
-            }
-            uint64_t dif = now - self.trig[c].ts;
-            if (T->send == SEND_SEQUENCE) {
-                pthread_mutex_lock (&self.seq_lock);
-                uint64_t notelen = qnote;
-                uint64_t gatelen;
-                char note = T->notes[self.trig[c].seqpos];
-                
-                switch (T->slen) {
-                    case 2: notelen *= 2; break;
-                    case 8: notelen /= 2; break;
-                    case 16: notelen /=4; break;
-                }
-                
-                /* If external syncing is enabled, slowly shift the
-                   sequencer clock forwards or backwards to meet the
-                   measured sync points */
-                if (CTX.ext_sync && self.last_sync > self.trig[c].ts) {
-                    uint64_t x = self.trig[c].ts;
-                    while (x < self.last_sync) x+= notelen;
-                    uint64_t desync = x-self.last_sync;
-                    if (desync) {
-                        
-                        /* we're early? */
-                        if (desync > (notelen/2)) {
-                            dif++;
-                            self.trig[c].ts--;
-                        }
-                        else { /* late */
-                            dif--;
-                            self.trig[c].ts++;
-                        }
-                    }
-                }
-
-                /* Calculate next offset from trigger start */
-                uint64_t next_offs = notelen * (self.trig[c].looppos+1);
-
-                /* Calculate active gate length */
-                gatelen = (notelen * (100-self.trig[c].gateperc)) / 100ULL;
-                
-                /* Close the gate if it is due */
-                if (self.noteon[note]) {
-                    if (dif >= (next_offs - gatelen)) {
-                        midi_send_noteoff (note);
-                    }
-                }
-                
-                /* Send next sequencer step if it is due */
-                if (dif >= next_offs) {
-                    midi_send_sequencer_step (c);
-                }
-                pthread_mutex_unlock (&self.seq_lock);
-            }
+        count = shaper_run (&o->shaper, getclock(), batch, OUTPUT_BATCH);
+        if (! count) break;
+        if (! self.backend->write (o->out, batch, count)) o->failed = true;
+        else midi_record_output (batch, count);
+    } while (ring_count (&o->output));
+    uint64_t retry = shaper_next (&o->shaper);
+    pthread_mutex_unlock (&o->lock);
+    return retry;
+}
+
+/** Write output to all ports.
+  * \return The earliest time to come back for messages held back on
+  *         any port, 0 if there are none.
+  */
+uint64_t midi_output_tick (void) {
+    uint64_t retry = 0;
+    for (int p=0; p<OUTPUT_PORTS; ++p) {
+        uint64_t next = midi_output_port (self.ports + p);
+        if (next && (! retry || next < retry)) retry = next;
+    }
+    return retry;
+}
+
+/** Thread that writes output to the ports whenever the engine has
+  * some, and when messages the shaper held back can go out.
+  */
+void midi_write_thread (thread *t) {
+    uint64_t retry = 0;
+    while (1) {
+        if (retry) {
+            struct timespec until = {
+                .tv_sec = (time_t) (retry / CLOCK_SEC),
+                .tv_nsec = (long) (retry % CLOCK_SEC)
+            };
+            conditional_wait_until (&self.outcond, &until);
         }
+        else conditional_wait (&self.outcond);
+        retry = midi_output_tick();
+    }
+}
+
+/** Build the output note map for the current transpose into the map
+  * that isn't in use, then swap it in.
+  */
+static void midi_build_notemap (void) {
+    uint8_t *cur = __atomic_load_n (&self.notemap, __ATOMIC_ACQUIRE);
+    uint8_t *next = (cur == self.notemaps[0]) ? self.notemaps[1]
+                                              : self.notemaps[0];
+    for (int i=0; i<128; ++i) {
+        int note = i + CTX.transpose;
+        if (note < 0) note = 0;
+        if (note > 127) note = 127;
+        next[i] = (uint8_t) note;
+    }
+    __atomic_store_n (&self.notemap, next, __ATOMIC_RELEASE);
+}
+
+/** Pick up a changed CTX.transpose. Notes that are already on keep
+  * their original output note until they are turned off.
+  */
+void midi_apply_transpose (void) {
+    if (! initialized) return;
+    midi_build_notemap();
+}
+
+/** Have the engine take over a newly loaded preset at the next beat or
+  * bar, see CTX.preset_switch */
+void midi_apply_preset (void) {
+    if (! initialized) return;
+    midi_wakeup();
+}
+
+/** Pick up a changed tempo of the published preset */
+void midi_apply_tempo (void) {
+    if (! initialized) return;
+    midi_lock();
+    midi_update_tempo();
+    midi_unlock();
+    midi_wakeup();
+}
+
+/** Compile the trigger matching tables of all input ports for the
+  * current settings into the tables the receive thread isn't using,
+  * then swap them in.
+  */
+static void midi_compile_matcher (void) {
+    for (int p=0; p<INPUT_PORTS; ++p) {
+        inport *in = self.inputs + p;
+        match_table *cur = __atomic_load_n (&in->matcher, __ATOMIC_ACQUIRE);
+        match_table *next = (cur == in->matchtab) ? in->matchtab+1
+                                                  : in->matchtab;
+        match_compile (next, CTX.trigger_type[p], CTX.custom_map,
+                       CTX.in_channel[p]);
+        __atomic_store_n (&in->matcher, next, __ATOMIC_RELEASE);
+    }
+}
+
+/** Pick the MIDI backend to use. The ALSA sequencer is preferred, with
+  * PortMidi as a fallback if it is configured, or if there is no
+  * sequencer to talk to.
+  */
+static void midi_select_backend (void) {
+    if (self.backend) return;
+#ifdef SIMULATION
+    MIDI_SIM.init();
+    self.backend = &MIDI_SIM;
+    return;
+#endif
+    if (CTX.backend != BACKEND_PORTMIDI && MIDI_ALSA.init()) {
+        self.backend = &MIDI_ALSA;
+    }
+    else {
+        MIDI_PORTMIDI.init();
+        self.backend = &MIDI_PORTMIDI;
+    }
+}
+
+/** Poll the backend for an available MIDI port */
+bool midi_available (void) {
+    midi_select_backend();
+    return self.backend->available();
+}
+
+/** Initialize internal information, without starting any threads */
+static void midi_setup (void) {
+    midi_select_backend();
+    voices_init (&self.voices);
+    memset (self.trig, 0, sizeof (self.trig));
+    pthread_mutex_init (&self.in_lock, NULL);
+    pthread_mutex_init (&self.seq_lock, NULL);
+    for (int p=0; p<INPUT_PORTS; ++p) {
+        self.inputs[p].in = NULL;
+        self.inputs[p].devicename[0] = 0;
+        self.inputs[p].matcher = NULL;
     }
+    for (int p=0; p<OUTPUT_PORTS; ++p) {
+        outport *o = self.ports + p;
+        pthread_mutex_init (&o->lock, NULL);
+        o->out = NULL;
+        o->devid = -1;
+        o->failed = false;
+        o->devicename[0] = 0;
+        o->batchsize = 0;
+        ring_init (&o->output, o->storage, sizeof (midi_msg),
+                   OUTPUT_RING_SIZE);
+        shaper_init (&o->shaper, 0);
+    }
+    self.latency = 0;
+    self.outtime = self.horizon = self.cause = 0;
+    self.outprio = PRIO_NOTE;
+    self.current = -1;
+    self.active = 0;
+    self.qnote = self.last_sync = 0;
+    extclock_init (&self.extclock);
+    midi_lock();
+    tempo_init (&self.tempo, getclock(), midi_centibpm());
+    midi_unlock();
+    self.rephase = self.clock_on = false;
+    self.switching = false;
+    self.switchpos = 0;
+    self.playing = self.starting = false;
+    self.songpos = 0;
+    sched_init (&self.schedule);
+    conditional_init (&self.wakeup);
+    ring_init (&self.input, self.input_storage, sizeof (inputevent),
+               INPUT_RING_SIZE);
+    conditional_init (&self.outcond);
+    self.backlog = false;
+    self.outfull = self.outlost = 0;
+    stats_counter ("input-full", &self.input.overflows);
+    stats_counter ("output-full", &self.outfull);
+    stats_counter ("output-lost", &self.outlost);
+    stats_counter ("sched-full", &self.schedule.overflows);
+    stats_counter ("sched-lost", &self.schedule.lost);
+    midi_compile_matcher();
+    self.notemap = NULL;
+    midi_build_notemap();
+    midi_clock_update();
 }
 
 /** Initialize internal information and start threads */
 void midi_init (void) {
     if (! initialized) {
-        for (int i=0; i<128; ++i) self.noteon[i] = false;
-        pthread_mutex_init (&self.in_lock, NULL);
-        pthread_mutex_init (&self.out_lock, NULL);
-        pthread_mutex_init (&self.seq_lock, NULL);
-        self.in = NULL;
-        self.out = NULL;
-        self.current = -1;
-        self.in_devicename[0] = self.out_devicename[0] = 0;
-        self.receive_thread = thread_create (midi_receive_thread, NULL);
-        self.send_thread = thread_create (midi_send_thread, NULL);
+        midi_setup();
+        self.receive_thread = thread_create (THREAD_MIDI_IN,
+                                             midi_receive_thread, NULL);
+        self.send_thread = thread_create (THREAD_ENGINE,
+                                          midi_send_thread, NULL);
+        self.write_thread = thread_create (THREAD_MIDI_OUT,
+                                           midi_write_thread, NULL);
         initialized = true;
     }
 }
 
-/** Set, or change, the PortMidi device to use for input */
-void midi_set_input_device (int devid) {
+/** Initialize internal information for a simulation run. No threads are
+  * started; the caller drives midi_input_tick(), midi_engine_tick() and
+  * midi_output_tick() itself, against a clock set with thread_set_clock().
+  */
+void midi_init_simulation (void) {
+    if (! initialized) {
+        midi_setup();
+        initialized = true;
+    }
+}
+
+/** Set, or change, the device to use for an input port.
+  * \param port The input port (0-3).
+  * \param devid The backend device id.
+  */
+void midi_set_input_device (int port, int devid) {
+    midi_devinfo info;
+    inport *in = self.inputs + port;
     pthread_mutex_lock (&self.in_lock);
-    if (self.in) {
-        Pm_Close (self.in);
-        self.in = NULL;
+    if (in->in) {
+        self.backend->close (in->in);
+        in->in = NULL;
+        in->devicename[0] = 0;
     }
     
-    Pm_OpenInput (&self.in, devid, NULL, 128, NULL, NULL);
-    Pm_SetFilter(self.in, PM_FILT_ACTIVE | PM_FILT_SYSEX);
+    in->in = self.backend->open_input (devid);
+    if (in->in && self.backend->get_device (devid, &info)) {
+        strcpy (in->devicename, info.name);
+    }
     pthread_mutex_unlock (&self.in_lock);
 }
 
-/** Set, or change, the PortMidi device to use for output */
-void midi_set_output_device (int devid) {
-    pthread_mutex_lock (&self.out_lock);
-    if (self.out) {
-        Pm_Close (self.out);
-        self.out = NULL;
+/** Returns the bandwidth of the configured output link in bytes/s, or
+  * 0 if it is not limited.
+  */
+static uint32_t midi_link_rate (void) {
+    return (CTX.out_link == LINK_DIN) ? SHAPER_DIN_RATE : 0;
+}
+
+/** Set, or change, the device to use for an output port. The device
+  * is opened with the configured look-ahead as its latency, which makes
+  * the backend honor message timestamps.
+  * \param port The output port (0-3).
+  * \param devid The backend device id.
+  */
+void midi_set_output_device (int port, int devid) {
+    midi_devinfo info;
+    outport *o = self.ports + port;
+    midi_lock();
+    pthread_mutex_lock (&o->lock);
+    if (o->out) {
+        self.backend->close (o->out);
+        o->out = NULL;
+        o->devicename[0] = 0;
     }
     
-    Pm_OpenOutput (&self.out, devid, NULL, 128, NULL, NULL, 0);
-    pthread_mutex_unlock (&self.out_lock);
+    o->devid = devid;
+    o->failed = false;
+    o->batchsize = 0;
+    self.latency = CTX.lookahead;
+    shaper_init (&o->shaper, midi_link_rate());
+    o->out = self.backend->open_output (devid, self.latency);
+    if (o->out && self.backend->get_device (devid, &info)) {
+        strcpy (o->devicename, info.name);
+    }
+    pthread_mutex_unlock (&o->lock);
+    midi_unlock();
+    midi_wakeup();
 }
 
-/** Check configuration for preferred MIDI ports. Hook up the first
-  * physical In and Out ports if nothing seems configued.
+/** Pick up changed global settings. Recompiles trigger matching,
+  * starts or stops the clock output, reopens the output ports if the
+  * look-ahead window changed, and resets their shapers if the output
+  * link type changed.
   */
-void midi_check_ports (void) {
-    int devcount = Pm_CountDevices();
-    if (! self.in_devicename[0]) {
-        if (! CTX.portname_midi_in[0]) {
-            /* Nothing configured, take the first in and out */
-            for (int i=2; i<devcount; ++i) {
-                const PmDeviceInfo *d = Pm_GetDeviceInfo (i);
-                if (d->input) {
-                    midi_set_input_device (i);
-                }
-                else if (d->output) {
-                    midi_set_output_device (i);
-                }
-                if (self.in_devicename[0] && self.out_devicename[0]) break;
-            }
+void midi_apply_settings (void) {
+    if (! initialized) return;
+    midi_compile_matcher();
+    midi_lock();
+    midi_clock_update();
+    midi_flush();
+    midi_unlock();
+    midi_wakeup();
+    /* Reopening a port latches the new look-ahead, so decide for all
+       ports up front */
+    bool relatch = self.latency != CTX.lookahead;
+    if (relatch) midi_stop_sequencer();
+    for (int p=0; p<OUTPUT_PORTS; ++p) {
+        outport *o = self.ports + p;
+        if (o->devid >= 0 && relatch) {
+            midi_set_output_device (p, o->devid);
+        }
+        else if (o->shaper.rate != midi_link_rate()) {
+            pthread_mutex_lock (&o->lock);
+            shaper_init (&o->shaper, midi_link_rate());
+            pthread_mutex_unlock (&o->lock);
         }
     }
-    if (CTX.portname_midi_in[0]) {
-        for (int i=2; i<devcount; ++i) {
-            const PmDeviceInfo *d = Pm_GetDeviceInfo (i);
-            if (strcmp (d->name, CTX.portname_midi_in) == 0) {
-                midi_set_input_device (i);
+}
+
+/** Check configuration for preferred MIDI ports, and open those that
+  * aren't open yet, or whose last write failed. Ports are looked up by
+  * their configured names. Hook up the first physical In and Out ports
+  * if nothing seems configured. Called regularly, so ports that come
+  * back after being unplugged get picked up again.
+  */
+void midi_check_ports (void) {
+    midi_devinfo d;
+    bool autoselect = ! CTX.portname_midi_in[0][0];
+    int devcount = self.backend->count_devices();
+    for (int i=0; i<devcount; ++i) {
+        if (! self.backend->get_device (i, &d)) continue;
+        for (int p=0; d.input && p<INPUT_PORTS; ++p) {
+            if (self.inputs[p].devicename[0]) continue;
+            const char *want = CTX.portname_midi_in[p];
+            bool match = want[0] ? strcmp (d.name, want) == 0
+                                 : (p == 0 && autoselect && ! d.system);
+            if (match) {
+                midi_set_input_device (p, i);
+                break;
             }
-            else if (strcmp (d->name, CTX.portname_midi_out) == 0) {
-                midi_set_output_device (i);
+        }
+        if (! d.output) continue;
+        for (int p=0; p<OUTPUT_PORTS; ++p) {
+            outport *o = self.ports + p;
+            if (o->out && ! o->failed) continue;
+            const char *want = CTX.portname_midi_out[p];
+            bool match = want[0] ? strcmp (d.name, want) == 0
+                                 : (p == 0 && autoselect && ! d.system);
+            if (match) {
+                midi_set_output_device (p, i);
+                break;
             }
         }
     }
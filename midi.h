@@ -1,15 +1,26 @@
 #ifndef _MIDI_H
 #define _MIDI_H 1
 
-#include <portmidi.h>
 #include <stdbool.h>
 
 #include "thread.h"
+#include "backend.h"
 
 bool midi_available (void);
 void midi_panic (void);
 void midi_stop_sequencer (void);
 void midi_init (void);
+void midi_init_simulation (void);
+int midi_input_tick (int timeout_ms);
+uint64_t midi_engine_tick (void);
+uint64_t midi_output_tick (void);
 void midi_check_ports (void);
+void midi_apply_settings (void);
+void midi_apply_transpose (void);
+void midi_apply_tempo (void);
+void midi_apply_preset (void);
+bool midi_sync_status (int *jitter_us);
+void midi_transport_stop (void);
+void midi_transport_continue (void);
 
 #endif
@@ -1,6 +1,9 @@
 #ifndef _PRESETS_H
 #define _PRESETS_H 1
 
+#include <stdbool.h>
+#include <stdint.h>
+
 /* =============================== TYPES =============================== */
 
 /** Defines how we handle velocity data */
@@ -70,14 +73,26 @@ typedef struct triggerpreset_s {
     gateconfig       sgate; /**< Sequencer gate settings */
     sequencerange    range; /**< Sequencer arpeggiator range */
     movetype         move; /**< Sequencer loop settings */
-    char             pad[20]; /**< Room for future expansion */
+    uint8_t          port; /**< Output port (0-3) */
+    uint8_t          channel; /**< Output channel (1-16), 0 for the global
+                                   send channel */
+    char             pad[18]; /**< Room for future expansion */
 } triggerpreset;
 
+/** Defines how sequence triggers share the sequencer */
+typedef enum {
+    SEQMODE_SINGLE = 0, /**< A new sequence replaces the running one */
+    SEQMODE_LAYERED /**< Every trigger runs its own sequence */
+} seqmode;
+
 /** Storage for a single, complete, preset */
 typedef struct preset_s {
     char             name[16]; /**< Preset name (max 13 chars) */
     triggerpreset    triggers[12]; /**< Per-trigger settings */
     int              tempo; /**< Sequencer tempo */
+    seqmode          seqmode; /**< How sequences share the sequencer */
+    uint8_t          tempo_frac; /**< Hundredths of a BPM on top of tempo */
+    char             pad[27]; /**< Room for future expansion */
 } preset;
 
 typedef enum {
@@ -86,22 +101,83 @@ typedef enum {
     TYPE_LASERHARP_9,
     TYPE_LASERHARP_10,
     TYPE_CHROMATIC,
-    TYPE_PEDALS_7
+    TYPE_PEDALS_7,
+    TYPE_CUSTOM /**< Note map from the configuration */
 } triggertype;
 
+/** MIDI backend selection */
+typedef enum {
+    BACKEND_ALSA, /**< ALSA sequencer, falls back to PortMidi */
+    BACKEND_PORTMIDI /**< PortMidi */
+} backendtype;
+
+/** Kind of link between the output port and the instrument */
+typedef enum {
+    LINK_USB = 0, /**< USB or virtual, no practical bandwidth limit */
+    LINK_DIN /**< Serial DIN MIDI at 31250 baud */
+} linktype;
+
+/** Where a newly loaded preset takes over from the running one */
+typedef enum {
+    SWITCH_BAR = 0, /**< At the next bar of four beats */
+    SWITCH_BEAT, /**< At the next beat */
+    SWITCH_NOW /**< Right away */
+} switchquant;
+
+/** Number of output ports */
+#define OUTPUT_PORTS 4
+
+/** Number of input ports */
+#define INPUT_PORTS 4
+
+/** Maximum number of steps in a compiled sequence */
+#define STEPS_MAX 72
+
+#define STEP_VELO_COPY       0x01 /**< Use the trigger velocity */
+#define STEP_VELO_RND_WIDE   0x02 /**< Random velocity 1-127 */
+#define STEP_VELO_RND_NARROW 0x04 /**< Random velocity 70-120 */
+#define STEP_GATE_RND_WIDE   0x08 /**< Random gate 5-95% */
+#define STEP_GATE_RND_NARROW 0x10 /**< Random gate 25-75% */
+
+/** A single step of a compiled sequence */
+typedef struct seqstep_s {
+    char             note; /**< Note to play, 0 for a rest */
+    uint8_t          velocity; /**< Fixed velocity, unless flagged */
+    uint8_t          gate; /**< Fixed gate length%, unless flagged */
+    uint8_t          flags; /**< STEP_* flags for runtime values */
+} seqstep;
+
+/** A trigger's sequence, compiled from its preset into the steps of
+  * one full cycle */
+typedef struct steptable_s {
+    int              length; /**< Number of steps in the cycle */
+    bool             single; /**< Stop after one cycle */
+    bool             random; /**< Pick a random step every time */
+    seqstep          steps[STEPS_MAX]; /**< The steps */
+} steptable;
+
 /** Global performance context */
 typedef struct context_global_s {
+    int              bank_nr; /**< Bank of the loaded preset (1-99) */
     int              preset_nr; /**< Number of loaded preset (1-99) */
     int              trigger_nr; /**< Edited trigger number (0-11) */
     preset           preset; /**< Working copy of loaded preset */
+    steptable        steps[12]; /**< Compiled sequences of the preset */
     int              transpose; /**< Current transpose */
-    preset           presets[100]; /**< Stored presets 1-99 */
-    char             portname_midi_in[256];
-    char             portname_midi_out[256];
-    triggertype      trigger_type;
+    char             portname_midi_in[INPUT_PORTS][256]; /**< Per port */
+    char             portname_midi_out[OUTPUT_PORTS][256]; /**< Per port */
+    triggertype      trigger_type[INPUT_PORTS]; /**< Per input port */
+    int              in_channel[INPUT_PORTS]; /**< Per input port (1-16),
+                                                   0 for all */
+    char             custom_map[128]; /**< Trigger+1 per note, TYPE_CUSTOM */
     int              send_channel;
     int              ext_tempo;
     int              ext_sync; /**< 1 if we should sync to midi */
+    int              clock_out; /**< 1 if we should send midi clock */
+    int              lookahead; /**< Output look-ahead window in ms */
+    backendtype      backend; /**< MIDI backend to use */
+    linktype         out_link; /**< Link type of the MIDI output */
+    switchquant      preset_switch; /**< When a loaded preset takes over */
 } context_global;
 
 /* ============================== GLOBALS ============================== */
@@ -113,6 +189,9 @@ extern context_global CTX;
 void context_init (void);
 void context_write_global (void);
 void context_load_preset (int nr);
+void context_compile_trigger (int trig);
+void context_publish_preset (void);
 void context_store_preset (void);
+const char *context_preset_name (int bank, int nr);
 
 #endif
@@ -0,0 +1,62 @@
+#include "ring.h"
+#include <string.h>
+
+/** Initialize a ring.
+  * \param storage Storage for count elements.
+  * \param elsize Size of a single element.
+  * \param count Number of slots, must be a power of two.
+  */
+void ring_init (ring *self, void *storage, size_t elsize, uint32_t count) {
+    self->head = self->tail = 0;
+    self->overflows = 0;
+    self->storage = (uint8_t *) storage;
+    self->elsize = elsize;
+    self->mask = count-1;
+}
+
+/** Add an element to the ring. Producer side only.
+  * \return false if the ring was full, and the element was dropped.
+  */
+bool ring_push (ring *self, const void *el) {
+    uint32_t head = self->head;
+    uint32_t tail = __atomic_load_n (&self->tail, __ATOMIC_ACQUIRE);
+    if (head - tail > self->mask) {
+        __atomic_fetch_add (&self->overflows, 1, __ATOMIC_RELAXED);
+        return false;
+    }
+    memcpy (self->storage + (head & self->mask) * self->elsize,
+            el, self->elsize);
+    __atomic_store_n (&self->head, head+1, __ATOMIC_RELEASE);
+    return true;
+}
+
+/** Take up to count elements off the ring. Consumer side only.
+  * \param into Room for count elements.
+  * \return The number of elements taken off.
+  */
+int ring_pop (ring *self, void *into, int count) {
+    uint32_t tail = self->tail;
+    uint32_t head = __atomic_load_n (&self->head, __ATOMIC_ACQUIRE);
+    uint32_t avail = head - tail;
+    if (avail > (uint32_t) count) avail = count;
+    uint8_t *out = (uint8_t *) into;
+    for (uint32_t i=0; i<avail; ++i) {
+        memcpy (out + i*self->elsize,
+                self->storage + ((tail+i) & self->mask) * self->elsize,
+                self->elsize);
+    }
+    __atomic_store_n (&self->tail, tail+avail, __ATOMIC_RELEASE);
+    return (int) avail;
+}
+
+/** Returns the number of elements waiting in the ring */
+uint32_t ring_count (ring *self) {
+    uint32_t head = __atomic_load_n (&self->head, __ATOMIC_ACQUIRE);
+    uint32_t tail = __atomic_load_n (&self->tail, __ATOMIC_ACQUIRE);
+    return head - tail;
+}
+
+/** Returns the number of elements dropped because the ring was full */
+uint32_t ring_overflows (ring *self) {
+    return __atomic_load_n (&self->overflows, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,34 @@
+#ifndef _RING_H
+#define _RING_H 1
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+/* =============================== TYPES =============================== */
+
+/** Lock-free single-producer/single-consumer ring buffer of fixed-size
+  * elements. Storage is handed in at initialization, nothing gets
+  * allocated afterwards. The head and tail live on separate cache lines
+  * so the two sides don't fight over them.
+  */
+typedef struct ring_s {
+    uint32_t         head; /**< Next slot to write, owned by producer */
+    uint32_t         overflows; /**< Elements dropped because of a full ring */
+    char             pad1[56];
+    uint32_t         tail; /**< Next slot to read, owned by consumer */
+    char             pad2[60];
+    uint8_t         *storage; /**< Element storage */
+    size_t           elsize; /**< Size of a single element */
+    uint32_t         mask; /**< Number of slots minus one */
+} ring;
+
+/* ============================= FUNCTIONS ============================= */
+
+void         ring_init (ring *, void *, size_t, uint32_t);
+bool         ring_push (ring *, const void *);
+int          ring_pop (ring *, void *, int);
+uint32_t     ring_count (ring *);
+uint32_t     ring_overflows (ring *);
+
+#endif
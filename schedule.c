@@ -0,0 +1,166 @@
+#include "schedule.h"
+
+/** Returns true if event a should run before event b */
+static inline bool sched_before (const sched_event *a, const sched_event *b) {
+    if (a->when != b->when) return a->when < b->when;
+    return a->type < b->type;
+}
+
+/** Move the event at position i up the heap until its parent runs
+  * before it.
+  */
+static void sched_sift_up (sched_queue *self, int i) {
+    sched_event e = self->ev[i];
+    while (i) {
+        int parent = (i-1) / 2;
+        if (! sched_before (&e, self->ev + parent)) break;
+        self->ev[i] = self->ev[parent];
+        i = parent;
+    }
+    self->ev[i] = e;
+}
+
+/** Move the event at position i down the heap until it runs before
+  * both its children.
+  */
+static void sched_sift_down (sched_queue *self, int i) {
+    sched_event e = self->ev[i];
+    while (1) {
+        int child = 2*i + 1;
+        if (child >= self->count) break;
+        if ((child+1 < self->count) &&
+            sched_before (self->ev + child+1, self->ev + child)) child++;
+        if (! sched_before (self->ev + child, &e)) break;
+        self->ev[i] = self->ev[child];
+        i = child;
+    }
+    self->ev[i] = e;
+}
+
+/** Move events from the spill area into the heap, as far as there is
+  * room for them.
+  */
+static void sched_refill (sched_queue *self) {
+    while (self->spilled && self->count < SCHED_MAX) {
+        int i = self->count++;
+        self->ev[i] = self->spill[--self->spilled];
+        sched_sift_up (self, i);
+    }
+}
+
+/** Returns the index of the earliest event in the spill area, -1 if
+  * it is empty */
+static int sched_spill_first (sched_queue *self) {
+    int first = -1;
+    for (int i=0; i<self->spilled; ++i) {
+        if (first < 0 || sched_before (self->spill + i,
+                                       self->spill + first)) first = i;
+    }
+    return first;
+}
+
+/** Initialize an empty schedule */
+void sched_init (sched_queue *self) {
+    self->count = 0;
+    self->spilled = 0;
+    self->overflows = self->lost = 0;
+}
+
+/** Add an event to the schedule. If the heap is full, the event waits
+  * in the spill area.
+  * \param when Absolute deadline of the event.
+  * \param type Event type.
+  * \param trig Trigger the event belongs to.
+  * \return false if there was no room for the event at all, and it got
+  *         dropped.
+  */
+bool sched_push (sched_queue *self, uint64_t when, int type, int trig) {
+    sched_event e = { .when = when, .type = type, .trig = trig };
+    if (self->count < SCHED_MAX) {
+        int i = self->count++;
+        self->ev[i] = e;
+        sched_sift_up (self, i);
+        return true;
+    }
+    __atomic_add_fetch (&self->overflows, 1, __ATOMIC_RELAXED);
+    if (self->spilled >= SCHED_SPILL) {
+        __atomic_add_fetch (&self->lost, 1, __ATOMIC_RELAXED);
+        return false;
+    }
+    self->spill[self->spilled++] = e;
+    return true;
+}
+
+/** Take the earliest event off the schedule, if it is due.
+  * \param now The current time.
+  * \param into Where to copy the event to.
+  * \return true if an event was taken off.
+  */
+bool sched_pop_due (sched_queue *self, uint64_t now, sched_event *into) {
+    int s = sched_spill_first (self);
+    if (s >= 0 && (! self->count ||
+                   sched_before (self->spill + s, self->ev))) {
+        if (self->spill[s].when > now) return false;
+        *into = self->spill[s];
+        self->spill[s] = self->spill[--self->spilled];
+        return true;
+    }
+    if (! self->count) return false;
+    if (self->ev[0].when > now) return false;
+    *into = self->ev[0];
+    if (--self->count) {
+        self->ev[0] = self->ev[self->count];
+        sched_sift_down (self, 0);
+    }
+    sched_refill (self);
+    return true;
+}
+
+/** Returns the deadline of the earliest pending event, or 0 if
+  * nothing is scheduled.
+  */
+uint64_t sched_next (sched_queue *self) {
+    int s = sched_spill_first (self);
+    if (s >= 0 && (! self->count ||
+                   sched_before (self->spill + s, self->ev))) {
+        return self->spill[s].when;
+    }
+    if (! self->count) return 0;
+    return self->ev[0].when;
+}
+
+/** Remove all pending events of a specific type for a trigger. The
+  * schedule is small, so a linear sweep followed by a rebuild of the
+  * heap is cheaper than keeping an index.
+  * \param type The event type, or -1 for any type.
+  * \param trig The trigger, or -1 for any trigger.
+  */
+void sched_cancel (sched_queue *self, int type, int trig) {
+    int out = 0;
+    for (int i=0; i<self->spilled; ++i) {
+        sched_event *e = self->spill + i;
+        if ((type < 0 || e->type == type) && (trig < 0 || e->trig == trig)) {
+            continue;
+        }
+        self->spill[out++] = *e;
+    }
+    self->spilled = out;
+    out = 0;
+    for (int i=0; i<self->count; ++i) {
+        sched_event *e = self->ev + i;
+        if ((type < 0 || e->type == type) && (trig < 0 || e->trig == trig)) {
+            continue;
+        }
+        self->ev[out++] = *e;
+    }
+    if (out == self->count) return;
+    self->count = out;
+    for (int i=(out/2)-1; i>=0; --i) sched_sift_down (self, i);
+    sched_refill (self);
+}
+
+/** Drop all pending events */
+void sched_clear (sched_queue *self) {
+    self->count = 0;
+    self->spilled = 0;
+}
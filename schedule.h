@@ -0,0 +1,46 @@
+#ifndef _SCHEDULE_H
+#define _SCHEDULE_H 1
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* =============================== TYPES =============================== */
+
+/** Maximum number of pending events in a schedule */
+#define SCHED_MAX 64
+
+/** Number of events put aside while the heap is full, until there is
+  * room for them again */
+#define SCHED_SPILL 16
+
+/** A single pending event, keyed by its absolute deadline */
+typedef struct sched_event_s {
+    uint64_t         when; /**< Absolute deadline (getclock() units) */
+    uint16_t         type; /**< Caller-defined event type */
+    uint16_t         trig; /**< Trigger the event belongs to */
+} sched_event;
+
+/** Binary min-heap of pending events, ordered by deadline, then by
+  * type for events with the same deadline. Events that find the heap
+  * full wait in a small unordered spill area, which is searched on
+  * every pop until they got moved into the heap.
+  */
+typedef struct sched_queue_s {
+    sched_event      ev[SCHED_MAX]; /**< Heap storage */
+    int              count; /**< Number of events in the heap */
+    sched_event      spill[SCHED_SPILL]; /**< Events waiting for room */
+    int              spilled; /**< Number of events in the spill area */
+    uint32_t         overflows; /**< Events that found the heap full */
+    uint32_t         lost; /**< Events dropped with the spill area full */
+} sched_queue;
+
+/* ============================= FUNCTIONS ============================= */
+
+void             sched_init (sched_queue *);
+bool             sched_push (sched_queue *, uint64_t, int, int);
+bool             sched_pop_due (sched_queue *, uint64_t, sched_event *);
+uint64_t         sched_next (sched_queue *);
+void             sched_cancel (sched_queue *, int, int);
+void             sched_clear (sched_queue *);
+
+#endif
@@ -0,0 +1,168 @@
+#include "shaper.h"
+#include "thread.h"
+#include <string.h>
+
+/** Maximum backlog on the link, in getclock() units. Lower priority
+  * messages are held back while the link is busier than this. */
+#define SHAPER_BACKLOG (3 * CLOCK_MSEC)
+
+/** Initialize a shaper.
+  * \param rate Link bandwidth in bytes/s, 0 for an unlimited link.
+  */
+void shaper_init (shaper *self, uint32_t rate) {
+    self->rate = rate;
+    self->busy_until = 0;
+    self->status = 0;
+    self->bytes = self->saved = self->deferred = self->dropped = 0;
+    self->npending = 0;
+}
+
+/** Returns the default priority for a message. Channel mode messages
+  * (controllers 120-127, such as All Notes Off) end notes the way
+  * note-offs do, so they go out with them, in order.
+  */
+outprio shaper_prio (uint32_t msg) {
+    uint8_t status = msg & 0xff;
+    if (status >= 0xf8 || status == 0xf2) return PRIO_REALTIME;
+    if ((status & 0xf0) == 0x80) return PRIO_NOTEOFF;
+    if ((status & 0xf0) == 0xb0 && (msg & 0x7f00) >= (120 << 8)) {
+        return PRIO_NOTEOFF;
+    }
+    if ((status & 0xf0) == 0x90) {
+        if (! (msg & 0x7f0000)) return PRIO_NOTEOFF;
+        return PRIO_NOTE;
+    }
+    return PRIO_OTHER;
+}
+
+/** Returns the channel and note of a note message, or -1 if the message
+  * isn't a note on (or off, if noteoff is set).
+  */
+static int shaper_note (uint32_t msg, bool noteoff) {
+    uint8_t status = msg & 0xf0;
+    bool off = (status == 0x80) || (status == 0x90 && ! (msg & 0x7f0000));
+    if ((status != 0x80 && status != 0x90) || off != noteoff) return -1;
+    return msg & 0x7f0f;
+}
+
+/** Work out the number of bytes a message takes on the wire, and
+  * update the running status.
+  */
+static int shaper_cost (shaper *self, uint32_t msg) {
+    uint8_t status = msg & 0xff;
+    int len = 3;
+    if (status >= 0xf8) return 1; /* realtime leaves running status be */
+    if (status >= 0xf0) {
+        self->status = 0; /* system common cancels running status */
+        if (status == 0xf2) return 3;
+        if (status == 0xf1 || status == 0xf3) return 2;
+        return 1;
+    }
+    if (status >= 0xc0 && status < 0xe0) len = 2;
+    if (status == self->status) {
+        self->saved++;
+        return len-1;
+    }
+    self->status = status;
+    return len;
+}
+
+/** Hold on to a batch of messages, to be released by shaper_run().
+  * \return The number of messages that fit.
+  */
+int shaper_add (shaper *self, const midi_msg *msgs, int count) {
+    int room = SHAPER_MAX - self->npending;
+    if (count > room) count = room;
+    memcpy (self->pending + self->npending, msgs, count * sizeof (midi_msg));
+    self->npending += count;
+    return count;
+}
+
+/** Release the messages that fit on the link right now. Messages are
+  * considered in priority order. Realtime messages and note-offs always
+  * go out. Anything else waits while the link would have more than a
+  * few milliseconds of backlog at the time the message is due. A
+  * note-off never overtakes the note on it ends: if that is still held
+  * back when the note-off goes out, the held back note is dropped. The
+  * note-off still goes out, as it may also end an earlier note on of
+  * the same key that was already sent.
+  * \param now The current time.
+  * \param into Room for max messages.
+  * \return The number of messages released.
+  */
+int shaper_run (shaper *self, uint64_t now, midi_msg *into, int max) {
+    int res = 0;
+    int keep = 0;
+    
+    if (! self->rate) {
+        /* Unlimited link, just pass through in order */
+        res = (self->npending > max) ? max : self->npending;
+        memcpy (into, self->pending, res * sizeof (midi_msg));
+        memmove (self->pending, self->pending + res,
+                 (self->npending - res) * sizeof (midi_msg));
+        self->npending -= res;
+        return res;
+    }
+    
+    /* Stable insertion sort on priority, the list is short. Note-offs
+       stay behind the note on they end */
+    for (int i=1; i<self->npending; ++i) {
+        midi_msg m = self->pending[i];
+        int key = shaper_note (m.message, true);
+        int j = i;
+        while (j && self->pending[j-1].prio > m.prio &&
+               (key < 0 ||
+                shaper_note (self->pending[j-1].message, false) != key)) {
+            self->pending[j] = self->pending[j-1];
+            j--;
+        }
+        self->pending[j] = m;
+    }
+    
+    for (int i=0; i<self->npending; ++i) {
+        midi_msg *m = self->pending + i;
+        uint64_t due = (m->when > now) ? m->when : now;
+        uint64_t start = (self->busy_until > due) ? self->busy_until : due;
+        
+        bool urgent = (m->prio <= PRIO_NOTEOFF);
+        if (res == max || (! urgent && start > due + SHAPER_BACKLOG)) {
+            if (keep != i) self->pending[keep] = *m;
+            keep++;
+            self->deferred++;
+            continue;
+        }
+        
+        /* Drop the held back note a note-off ends, but not the
+           note-off */
+        int key = shaper_note (m->message, true);
+        int held = keep;
+        while (key >= 0 && held &&
+               shaper_note (self->pending[held-1].message, false) != key) {
+            held--;
+        }
+        if (key >= 0 && held) {
+            memmove (self->pending + held-1, self->pending + held,
+                     (keep - held) * sizeof (midi_msg));
+            keep--;
+            self->dropped++;
+        }
+        
+        int cost = shaper_cost (self, m->message);
+        self->bytes += cost;
+        self->busy_until = start +
+                           (cost * CLOCK_SEC + self->rate-1) / self->rate;
+        into[res++] = *m;
+    }
+    self->npending = keep;
+    return res;
+}
+
+/** Returns the time at which held back messages can be retried, or 0
+  * if nothing is held back. The link is left with half the maximum
+  * backlog, so it keeps going while the next few messages are released.
+  */
+uint64_t shaper_next (shaper *self) {
+    if (! self->npending) return 0;
+    if (self->busy_until < SHAPER_BACKLOG) return 1;
+    return self->busy_until - SHAPER_BACKLOG/2;
+}
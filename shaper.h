@@ -0,0 +1,49 @@
+#ifndef _SHAPER_H
+#define _SHAPER_H 1
+
+#include "backend.h"
+
+/* =============================== TYPES =============================== */
+
+/** Maximum number of messages held back by a shaper */
+#define SHAPER_MAX 512
+
+/** Bandwidth of a DIN MIDI link in bytes per second (31250 baud) */
+#define SHAPER_DIN_RATE 3125
+
+/** Output priorities, lower goes first when the link is saturated */
+typedef enum {
+    PRIO_REALTIME = 0, /**< Clock and transport */
+    PRIO_NOTEOFF = 1, /**< Note off, note on with velocity 0, or
+                           channel mode message */
+    PRIO_STEP = 2, /**< The current sequencer step */
+    PRIO_NOTE = 3, /**< Other notes */
+    PRIO_OTHER = 4 /**< Everything else */
+} outprio;
+
+/** Bandwidth model of a single output link. Keeps track of how long
+  * the link stays busy with what was already sent, counting running
+  * status the way a serial MIDI encoder would apply it.
+  */
+typedef struct shaper_s {
+    uint32_t         rate; /**< Link bandwidth in bytes/s, 0 if unlimited */
+    uint64_t         busy_until; /**< getclock() time the link drains */
+    uint8_t          status; /**< Running status on the link */
+    uint64_t         bytes; /**< Total bytes that went over the link */
+    uint64_t         saved; /**< Bytes saved by running status */
+    uint64_t         deferred; /**< Times a message was held back */
+    uint64_t         dropped; /**< Held back notes dropped because
+                                   their note-off was due */
+    int              npending; /**< Number of messages held back */
+    midi_msg         pending[SHAPER_MAX]; /**< Messages held back */
+} shaper;
+
+/* ============================= FUNCTIONS ============================= */
+
+void         shaper_init (shaper *, uint32_t);
+int          shaper_add (shaper *, const midi_msg *, int);
+int          shaper_run (shaper *, uint64_t, midi_msg *, int);
+uint64_t     shaper_next (shaper *);
+outprio      shaper_prio (uint32_t);
+
+#endif
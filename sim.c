@@ -0,0 +1,391 @@
+/** Deterministic simulation of the MIDI engine. Runs the receive, engine
+  * and write stages one after the other against a virtual clock, feeds
+  * them input from a script, and prints what comes out. The same script
+  * gives the same output on any machine, at any load, so changes to
+  * the timing code can be checked by comparing the output before and
+  * after.
+  *
+  * Build with -DSIMULATION, see README.md. Usage: tmsim [script], the
+  * script is read from stdin if none is given. Every line is a command,
+  * optionally preceded by the time in ms it takes effect and a colon,
+  * as in "500: 90 24 64". Commands before the first time are applied
+  * before the engine starts, later ones without a time along with the
+  * line before. Times have to be in order, and the simulation stops at
+  * the last line.
+  *
+  *     <hex bytes>                  MIDI input, e.g. "90 24 64"
+  *     in <n> <hex bytes>           MIDI input on device n (1-4)
+  *     tempo <bpm>                  Preset tempo, e.g. "124.37"
+  *     lookahead <ms>               Output look-ahead window
+  *     extsync <0|1>                Follow external clock
+  *     clockout <0|1>               Send clock
+  *     link <usb|din>               Output link type
+  *     inport <n> <name>            Name of input port n (1-4), one of
+  *                                  the devices "sim" or "sim 2" to
+  *                                  "sim 4"
+  *     outport <n> <name>           Name of output port n (1-4)
+  *     trigtype <n> [port]          Trigger type, see presets.h, of input
+  *                                  port 1-4 (default 1)
+  *     inchannel <n> [port]         Input channel, 0 for all, of input
+  *                                  port 1-4 (default 1)
+  *     map <note> <trigger>         Custom trigger map entry (1-12)
+  *     seqmode <single|layered>     How sequences share the sequencer
+  *     library <file>               Preset library to load presets
+  *                                  from, once per script
+  *     preset <bank> <nr>           Load a preset from the library
+  *     switch <bank> <nr>           Load a preset from the library the
+  *                                  way the preset buttons do, taking
+  *                                  over at the next beat or bar
+  *     presetswitch <bar|beat|now>  Where a switched preset takes over
+  *     trigger <n> <key> <value>... Trigger settings (1-12), with keys
+  *                                  notes (comma separated), send (notes
+  *                                  or seq), nmode, slen, sgate, range,
+  *                                  move, vconf, port (1-4) and channel
+  *                                  (1-16, 0 for the send channel)
+  *     end                          Does nothing, marks the end time
+  *
+  * Output lines hold the time each message was written, the time it is
+  * delivered at, both in ns, the device it went to, and its bytes in
+  * hex.
+  */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "presets.h"
+#include "steps.h"
+#include "midi.h"
+#include "sim.h"
+#include "snapshot.h"
+#include "store.h"
+
+/** Virtual time the simulation starts at. Not 0, as a timestamp of 0
+  * means 'immediate' to the engine. */
+#define SIM_EPOCH CLOCK_SEC
+
+context_global CTX;
+
+/** The virtual clock */
+static uint64_t simclock = SIM_EPOCH;
+
+/** True once the engine runs */
+static bool started = false;
+
+/** True once the preset library is open */
+static bool library = false;
+
+/** Time source for getclock() */
+static uint64_t sim_getclock (void) {
+    return simclock;
+}
+
+/** The simulation has no buttons to flash */
+void button_manager_flash_midi_in (void) {}
+void button_manager_flash_midi_out (void) {}
+
+/** Set up the working preset the way an empty preset gets loaded */
+static void sim_init_preset (void) {
+    strcpy (CTX.preset.name, "Simulation");
+    CTX.preset.tempo = 125;
+    for (int i=0; i<12; ++i) {
+        triggerpreset *tp = CTX.preset.triggers + i;
+        tp->notes[0] = 48+i;
+        tp->slen = 8;
+        tp->sgate = 50;
+        tp->move = MOVE_LOOP_UP;
+    }
+}
+
+/** Compile the steps of all triggers */
+static void sim_compile (void) {
+    for (int i=0; i<12; ++i) {
+        steps_compile (CTX.steps + i, CTX.preset.triggers + i);
+    }
+}
+
+/** Load a preset from the library. Fails for a preset that was never
+  * stored, rather than making one up. */
+static bool sim_load_preset (int bank, int nr) {
+    preset p;
+    if (! library || ! store_read (bank, nr, &p)) return false;
+    CTX.preset = p;
+    return true;
+}
+
+/** Set a port name from the rest of a command, as device names can
+  * have spaces.
+  */
+static void sim_port_name (char *into, int argc, char *argv[]) {
+    strcpy (into, argv[2]);
+    for (int i=3; i<argc; ++i) {
+        strcat (into, " ");
+        strcat (into, argv[i]);
+    }
+}
+
+/** Returns the input port (0-3) a command optionally names in its
+  * third argument, -1 if it is out of range.
+  */
+static int sim_input_arg (int argc, char *argv[]) {
+    int port = (argc > 2) ? atoi (argv[2]) - 1 : 0;
+    return (port < 0 || port >= INPUT_PORTS) ? -1 : port;
+}
+
+/** Queue MIDI input given as hex bytes.
+  * \return false if the bytes can't be parsed.
+  */
+static bool sim_input (int devid, int argc, char *argv[]) {
+    uint32_t msg = 0;
+    for (int i=0; i<argc && i<3; ++i) {
+        char *end;
+        unsigned long b = strtoul (argv[i], &end, 16);
+        if (*end || b > 0xff) return false;
+        msg |= (uint32_t) b << (8*i);
+    }
+    if (! started) return false;
+    sim_push_input (devid, msg);
+    return true;
+}
+
+/** Apply a trigger setting.
+  * \return false if the key is unknown.
+  */
+static bool sim_trigger_setting (triggerpreset *tp, const char *key,
+                                 const char *value) {
+    if (strcmp (key, "notes") == 0) {
+        memset (tp->notes, 0, sizeof (tp->notes));
+        tp->lastnote = 0;
+        for (int i=0; i<8 && *value; ++i) {
+            tp->notes[i] = atoi (value);
+            tp->lastnote = i;
+            value = strchr (value, ',');
+            if (! value) break;
+            value++;
+        }
+    }
+    else if (strcmp (key, "send") == 0) {
+        tp->send = (strcmp (value, "seq") == 0) ? SEND_SEQUENCE : SEND_NOTES;
+    }
+    else if (strcmp (key, "nmode") == 0) tp->nmode = atoi (value);
+    else if (strcmp (key, "slen") == 0) tp->slen = atoi (value);
+    else if (strcmp (key, "sgate") == 0) tp->sgate = atoi (value);
+    else if (strcmp (key, "range") == 0) tp->range = atoi (value);
+    else if (strcmp (key, "move") == 0) tp->move = atoi (value);
+    else if (strcmp (key, "vconf") == 0) tp->vconf = atoi (value);
+    else if (strcmp (key, "port") == 0) tp->port = atoi (value) - 1;
+    else if (strcmp (key, "channel") == 0) tp->channel = atoi (value);
+    else return false;
+    return true;
+}
+
+/** Carry out a script command.
+  * \return false if the command is not understood.
+  */
+static bool sim_apply (char *cmd) {
+    char *argv[20];
+    int argc = 0;
+    for (char *tok = strtok (cmd, " \t"); tok && argc < 20;
+         tok = strtok (NULL, " \t")) {
+        argv[argc++] = tok;
+    }
+    if (! argc) return true;
+
+    const char *arg = (argc > 1) ? argv[1] : "0";
+    if (strcmp (argv[0], "tempo") == 0) {
+        int centibpm = (int) (atof (arg) * 100.0 + 0.5);
+        CTX.preset.tempo = centibpm / 100;
+        CTX.preset.tempo_frac = centibpm % 100;
+        midi_apply_tempo();
+    }
+    else if (strcmp (argv[0], "lookahead") == 0) {
+        CTX.lookahead = atoi (arg);
+        midi_apply_settings();
+    }
+    else if (strcmp (argv[0], "extsync") == 0) {
+        CTX.ext_sync = atoi (arg);
+        midi_apply_settings();
+    }
+    else if (strcmp (argv[0], "clockout") == 0) {
+        CTX.clock_out = atoi (arg);
+        midi_apply_settings();
+    }
+    else if (strcmp (argv[0], "link") == 0) {
+        CTX.out_link = (strcmp (arg, "din") == 0) ? LINK_DIN : LINK_USB;
+        midi_apply_settings();
+    }
+    else if (strcmp (argv[0], "inport") == 0 && argc > 2) {
+        int port = atoi (argv[1]) - 1;
+        if (port < 0 || port >= INPUT_PORTS) return false;
+        sim_port_name (CTX.portname_midi_in[port], argc, argv);
+        if (started) midi_check_ports();
+    }
+    else if (strcmp (argv[0], "outport") == 0 && argc > 2) {
+        int port = atoi (argv[1]) - 1;
+        if (port < 0 || port >= OUTPUT_PORTS) return false;
+        sim_port_name (CTX.portname_midi_out[port], argc, argv);
+        if (started) midi_check_ports();
+    }
+    else if (strcmp (argv[0], "trigtype") == 0) {
+        int port = sim_input_arg (argc, argv);
+        if (port < 0) return false;
+        CTX.trigger_type[port] = (triggertype) atoi (arg);
+        midi_apply_settings();
+    }
+    else if (strcmp (argv[0], "inchannel") == 0) {
+        int port = sim_input_arg (argc, argv);
+        if (port < 0) return false;
+        CTX.in_channel[port] = atoi (arg);
+        midi_apply_settings();
+    }
+    else if (strcmp (argv[0], "map") == 0 && argc > 2) {
+        int note = atoi (argv[1]);
+        if (note < 0 || note > 127) return false;
+        CTX.custom_map[note] = atoi (argv[2]);
+        midi_apply_settings();
+    }
+    else if (strcmp (argv[0], "seqmode") == 0) {
+        CTX.preset.seqmode = (strcmp (arg, "layered") == 0)
+                             ? SEQMODE_LAYERED : SEQMODE_SINGLE;
+    }
+    else if (strcmp (argv[0], "library") == 0 && argc > 1) {
+        if (library) return false;
+        library = store_open (argv[1]);
+        if (! library) return false;
+    }
+    else if (strcmp (argv[0], "preset") == 0 && argc > 2) {
+        if (! sim_load_preset (atoi (argv[1]), atoi (argv[2]))) {
+            return false;
+        }
+        sim_compile();
+        midi_apply_tempo();
+    }
+    else if (strcmp (argv[0], "switch") == 0 && argc > 2) {
+        if (! sim_load_preset (atoi (argv[1]), atoi (argv[2]))) {
+            return false;
+        }
+        sim_compile();
+        snapshot_queue (&CTX.preset, CTX.steps);
+        midi_apply_preset();
+    }
+    else if (strcmp (argv[0], "presetswitch") == 0) {
+        if (strcmp (arg, "beat") == 0) CTX.preset_switch = SWITCH_BEAT;
+        else if (strcmp (arg, "now") == 0) CTX.preset_switch = SWITCH_NOW;
+        else CTX.preset_switch = SWITCH_BAR;
+    }
+    else if (strcmp (argv[0], "trigger") == 0 && argc > 1) {
+        int trig = atoi (argv[1]) - 1;
+        if (trig < 0 || trig > 11) return false;
+        for (int i=2; i+1<argc; i+=2) {
+            if (! sim_trigger_setting (CTX.preset.triggers + trig,
+                                       argv[i], argv[i+1])) return false;
+        }
+        steps_compile (CTX.steps + trig, CTX.preset.triggers + trig);
+    }
+    else if (strcmp (argv[0], "in") == 0 && argc > 2) {
+        int devid = atoi (argv[1]) - 1;
+        if (devid < 0 || devid >= INPUT_PORTS) return false;
+        return sim_input (devid, argc-2, argv+2);
+    }
+    else if (strcmp (argv[0], "end") == 0) return true;
+    else return sim_input (0, argc, argv);
+    return true;
+}
+
+/** Carry out a script command, and publish whatever it changed in the
+  * preset to the engine, the way the UI does.
+  * \return false if the command is not understood.
+  */
+static bool sim_command (char *cmd) {
+    bool res = sim_apply (cmd);
+    snapshot_publish (&CTX.preset, CTX.steps);
+    return res;
+}
+
+/** A line of the script, split into its time and command */
+typedef struct simline_s {
+    bool             timed; /**< True if the line has a time */
+    uint64_t         when; /**< Time of the command, in ns */
+    char            *cmd; /**< The command */
+} simline;
+
+/** Read the next script line that has a command.
+  * \return false at the end of the script.
+  */
+static bool sim_read_line (FILE *f, char *buf, size_t sz, simline *into) {
+    while (fgets (buf, sz, f)) {
+        char *c = strchr (buf, '#');
+        if (c) *c = 0;
+        c = buf + strlen (buf);
+        while (c > buf && (c[-1] == '\n' || c[-1] == '\r' ||
+                           c[-1] == ' ' || c[-1] == '\t')) *--c = 0;
+        c = buf;
+        while (*c == ' ' || *c == '\t') c++;
+        if (! *c) continue;
+
+        /* A leading time ends in a colon */
+        char *end;
+        double ms = strtod (c, &end);
+        into->timed = (end != c && *end == ':');
+        if (into->timed) {
+            into->when = SIM_EPOCH + (uint64_t) (ms * CLOCK_MSEC);
+            c = end + 1;
+            while (*c == ' ' || *c == '\t') c++;
+        }
+        into->cmd = c;
+        return true;
+    }
+    return false;
+}
+
+int main (int argc, const char *argv[]) {
+    FILE *script = stdin;
+    if (argc > 1 && ! (script = fopen (argv[1], "r"))) {
+        fprintf (stderr, "%s: can't open %s\n", argv[0], argv[1]);
+        return 1;
+    }
+
+    thread_set_clock (sim_getclock);
+    sim_setup (stdout, SIM_EPOCH);
+    srand (1);
+    sim_init_preset();
+
+    char buf[1024];
+    simline line;
+    bool pending = sim_read_line (script, buf, sizeof (buf), &line);
+    while (pending && ! line.timed) {
+        if (! sim_command (line.cmd)) {
+            fprintf (stderr, "bad command: %s\n", line.cmd);
+            return 1;
+        }
+        pending = sim_read_line (script, buf, sizeof (buf), &line);
+    }
+
+    sim_compile();
+    snapshot_publish (&CTX.preset, CTX.steps);
+    midi_init_simulation();
+    midi_check_ports();
+    started = true;
+
+    /* Run every stage at every point in time where one of them has
+       something to do, until the script runs out */
+    while (1) {
+        while (pending && line.when <= simclock) {
+            if (! sim_command (line.cmd)) {
+                fprintf (stderr, "bad command: %s\n", line.cmd);
+                return 1;
+            }
+            pending = sim_read_line (script, buf, sizeof (buf), &line);
+            if (pending && ! line.timed) line.when = simclock;
+        }
+
+        midi_input_tick (0);
+        uint64_t next = midi_engine_tick();
+        uint64_t retry = midi_output_tick();
+
+        if (! pending) break;
+        uint64_t until = line.when;
+        if (next && next < until) until = next;
+        if (retry && retry < until) until = retry;
+        simclock = (until > simclock) ? until : simclock + 1;
+    }
+    return 0;
+}
@@ -0,0 +1,14 @@
+#ifndef _SIM_H
+#define _SIM_H 1
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/* ============================= FUNCTIONS ============================= */
+
+void         sim_setup (FILE *, uint64_t);
+bool         sim_push_input (int, uint32_t);
+uint64_t     sim_output_count (void);
+
+#endif
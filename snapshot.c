@@ -0,0 +1,164 @@
+#include "snapshot.h"
+#include <string.h>
+#include <time.h>
+
+/** Epoch based reclamation of preset snapshots. There is one writer,
+  * the thread that owns CTX.preset, which publishes a new snapshot by
+  * swapping a single pointer. Readers pin the epoch they start reading
+  * in, and a snapshot that got replaced is only reused once no reader
+  * is left that started reading before it was replaced. Readers never
+  * wait, and take no locks.
+  *
+  * A snapshot can also be queued, for a reader to swap in at a moment
+  * of its choosing. Until then nobody reads it, and the writer can
+  * replace it right away.
+  */
+
+/** A slot of the snapshot pool */
+typedef struct snapslot_s {
+    snapshot         snap; /**< The snapshot, first so it casts back */
+    bool             used; /**< In use, writer side */
+    uint64_t         retired; /**< Epoch it was replaced in, 0 if current
+                                   or queued */
+} snapslot;
+
+/** Snapshot state */
+static struct snapstate {
+    snapslot         pool[SNAPSHOT_POOL]; /**< Snapshots */
+    snapshot        *current; /**< The published snapshot */
+    snapshot        *queued; /**< Snapshot waiting to be taken, or NULL */
+    uint64_t         epoch; /**< Current epoch, starting at 1 */
+    uint64_t         pinned[SNAPSHOT_READERS]; /**< Epoch a reader started
+                                                    reading in, 0 if idle */
+} self = { .epoch = 1 };
+
+/** Mark retired snapshots that no reader can still see as free */
+static void snapshot_reclaim (void) {
+    uint64_t oldest = UINT64_MAX;
+    for (int r=0; r<SNAPSHOT_READERS; ++r) {
+        uint64_t e = __atomic_load_n (self.pinned + r, __ATOMIC_SEQ_CST);
+        if (e && e < oldest) oldest = e;
+    }
+    for (int i=0; i<SNAPSHOT_POOL; ++i) {
+        snapslot *s = self.pool + i;
+        uint64_t retired = __atomic_load_n (&s->retired, __ATOMIC_SEQ_CST);
+        if (s->used && retired && retired < oldest) s->used = false;
+    }
+}
+
+/** Returns a free slot of the pool, waiting for readers to move on if
+  * there is none. Readers only hold on to a snapshot for a tick of the
+  * engine, so that doesn't take long.
+  */
+static snapslot *snapshot_alloc (void) {
+    while (1) {
+        snapshot_reclaim();
+        for (int i=0; i<SNAPSHOT_POOL; ++i) {
+            if (! self.pool[i].used) return self.pool + i;
+        }
+        struct timespec ms = { 0, 1000000 };
+        nanosleep (&ms, NULL);
+    }
+}
+
+/** Retire a snapshot that was just swapped out as the current one.
+  * Readers that pin a later epoch can only see its replacement.
+  */
+static void snapshot_retire (snapshot *s) {
+    uint64_t e = __atomic_fetch_add (&self.epoch, 1, __ATOMIC_SEQ_CST);
+    if (s) __atomic_store_n (&((snapslot *) s)->retired, e, __ATOMIC_SEQ_CST);
+}
+
+/** Make a snapshot of a preset and its compiled sequences, unless it
+  * is the same as the latest one, current or queued.
+  * \return The new snapshot, NULL if nothing changed.
+  */
+static snapshot *snapshot_make (const preset *p, const steptable *steps) {
+    snapshot *last = __atomic_load_n (&self.queued, __ATOMIC_SEQ_CST);
+    if (! last) last = self.current;
+    if (last && memcmp (&last->preset, p, sizeof (preset)) == 0 &&
+        memcmp (last->steps, steps, sizeof (last->steps)) == 0) return NULL;
+
+    snapslot *s = snapshot_alloc();
+    memcpy (&s->snap.preset, p, sizeof (preset));
+    memcpy (s->snap.steps, steps, sizeof (s->snap.steps));
+    s->used = true;
+    __atomic_store_n (&s->retired, 0, __ATOMIC_SEQ_CST);
+    return &s->snap;
+}
+
+/** Queue a snapshot, replacing the one that was waiting, if any */
+static void snapshot_enqueue (snapshot *s) {
+    snapshot *old = __atomic_exchange_n (&self.queued, s, __ATOMIC_SEQ_CST);
+    if (old) ((snapslot *) old)->used = false; /* never seen by anyone */
+}
+
+/** Publish a preset and its compiled sequences to the readers. Writer
+  * side only. If a snapshot is queued, it is replaced instead, as the
+  * preset being edited is the one that is about to take over. The
+  * reader may take the queued one at any time, so the replacement is a
+  * single compare-and-swap, and if that finds it gone, the snapshot is
+  * published right away. Does nothing if nothing changed since the last
+  * publish or queue.
+  * \return true if a new snapshot was published.
+  */
+bool snapshot_publish (const preset *p, const steptable *steps) {
+    snapshot *s = snapshot_make (p, steps);
+    if (! s) return false;
+    snapshot *old = __atomic_load_n (&self.queued, __ATOMIC_SEQ_CST);
+    if (old && __atomic_compare_exchange_n (&self.queued, &old, s, false,
+                                            __ATOMIC_SEQ_CST,
+                                            __ATOMIC_SEQ_CST)) {
+        ((snapslot *) old)->used = false; /* never seen by anyone */
+        return true;
+    }
+    snapshot_retire (__atomic_exchange_n (&self.current, s,
+                                          __ATOMIC_SEQ_CST));
+    return true;
+}
+
+/** Queue a preset and its compiled sequences, for a reader to take
+  * over with snapshot_take(). Writer side only.
+  * \return true if a new snapshot was queued.
+  */
+bool snapshot_queue (const preset *p, const steptable *steps) {
+    snapshot *s = snapshot_make (p, steps);
+    if (! s) return false;
+    snapshot_enqueue (s);
+    return true;
+}
+
+/** Returns true if a snapshot is queued */
+bool snapshot_pending (void) {
+    return __atomic_load_n (&self.queued, __ATOMIC_SEQ_CST) != NULL;
+}
+
+/** Make the queued snapshot the current one. The reader has to be in
+  * snapshot_enter(), and can go on reading the snapshot it had until it
+  * leaves.
+  * \return The new current snapshot, NULL if nothing was queued.
+  */
+const snapshot *snapshot_take (void) {
+    snapshot *s = __atomic_exchange_n (&self.queued, NULL, __ATOMIC_SEQ_CST);
+    if (! s) return NULL;
+    snapshot_retire (__atomic_exchange_n (&self.current, s,
+                                          __ATOMIC_SEQ_CST));
+    return s;
+}
+
+/** Start reading the current snapshot. It stays valid until the reader
+  * calls snapshot_leave(). A reader can't enter twice.
+  * \return The snapshot, an empty one if nothing was published yet.
+  */
+const snapshot *snapshot_enter (snapshotreader r) {
+    static const snapshot empty;
+    uint64_t e = __atomic_load_n (&self.epoch, __ATOMIC_SEQ_CST);
+    __atomic_store_n (self.pinned + r, e, __ATOMIC_SEQ_CST);
+    const snapshot *s = __atomic_load_n (&self.current, __ATOMIC_SEQ_CST);
+    return s ? s : &empty;
+}
+
+/** Stop reading the snapshot returned by snapshot_enter() */
+void snapshot_leave (snapshotreader r) {
+    __atomic_store_n (self.pinned + r, 0, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,38 @@
+#ifndef _SNAPSHOT_H
+#define _SNAPSHOT_H 1
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "presets.h"
+
+/* =============================== TYPES =============================== */
+
+/** Number of snapshots kept around: the current one, a queued one,
+  * and those that readers may still be looking at */
+#define SNAPSHOT_POOL 4
+
+/** Readers of snapshots, each has its own epoch slot */
+typedef enum {
+    SNAPSHOT_ENGINE = 0, /**< Whoever holds the engine's sequencer lock */
+    SNAPSHOT_READERS
+} snapshotreader;
+
+/** An immutable copy of the working preset and its compiled sequences,
+  * as published to the MIDI engine. Never changes while a reader can
+  * see it.
+  */
+typedef struct snapshot_s {
+    preset           preset; /**< The preset */
+    steptable        steps[12]; /**< Its compiled sequences */
+} snapshot;
+
+/* ============================= FUNCTIONS ============================= */
+
+bool             snapshot_publish (const preset *, const steptable *);
+bool             snapshot_queue (const preset *, const steptable *);
+bool             snapshot_pending (void);
+const snapshot  *snapshot_take (void);
+const snapshot  *snapshot_enter (snapshotreader);
+void             snapshot_leave (snapshotreader);
+
+#endif
@@ -0,0 +1,126 @@
+#include "stats.h"
+#include <stdio.h>
+#include <signal.h>
+
+/** Names of the histograms in the dump */
+static const char *STAT_NAMES[STAT_COUNT] = {
+    "match", "queue", "write", "in-out", "step", "gate", "sync"
+};
+
+/** The histograms */
+static histogram HIST[STAT_COUNT];
+
+/** A counter kept by some other module, shown in the dump */
+typedef struct counter_s {
+    const char      *name; /**< Name in the dump */
+    const uint32_t  *value; /**< The counter, read with relaxed atomics */
+} counter;
+
+/** The counters in the dump */
+static counter COUNTERS[STATS_COUNTERS];
+
+/** Number of counters in the dump */
+static int ncounters = 0;
+
+/** Set from the signal handler when a dump is wanted */
+static volatile sig_atomic_t dump_requested = 0;
+
+/** Record a value. Costs a count-leading-zeros and a few relaxed
+  * atomic adds, so it's fine to call on every event.
+  * \param id The histogram to record into.
+  * \param ns The value, in ns.
+  */
+void stats_record (statid id, uint64_t ns) {
+    histogram *h = HIST + id;
+    int b = ns ? 64 - __builtin_clzll (ns) : 0;
+    if (b >= STATS_BUCKETS) b = STATS_BUCKETS-1;
+    __atomic_add_fetch (h->bucket + b, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch (&h->count, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch (&h->sum, ns, __ATOMIC_RELAXED);
+
+    uint64_t max = __atomic_load_n (&h->max, __ATOMIC_RELAXED);
+    while (ns > max) {
+        if (__atomic_compare_exchange_n (&h->max, &max, ns, true,
+                                         __ATOMIC_RELAXED,
+                                         __ATOMIC_RELAXED)) break;
+    }
+}
+
+/** Add a counter to the dump, such as the number of times a queue was
+  * found full. The counter stays where it is kept, and keeps counting
+  * across stats_reset(). Call during initialization only.
+  * \param name The name to show it under.
+  * \param value The counter.
+  */
+void stats_counter (const char *name, const uint32_t *value) {
+    if (ncounters >= STATS_COUNTERS) return;
+    COUNTERS[ncounters].name = name;
+    COUNTERS[ncounters].value = value;
+    ncounters++;
+}
+
+/** Clear all histograms */
+void stats_reset (void) {
+    for (int i=0; i<STAT_COUNT; ++i) {
+        histogram *h = HIST + i;
+        for (int b=0; b<STATS_BUCKETS; ++b) {
+            __atomic_store_n (h->bucket + b, 0, __ATOMIC_RELAXED);
+        }
+        __atomic_store_n (&h->count, 0, __ATOMIC_RELAXED);
+        __atomic_store_n (&h->sum, 0, __ATOMIC_RELAXED);
+        __atomic_store_n (&h->max, 0, __ATOMIC_RELAXED);
+    }
+}
+
+/** Write all histograms to a file. Every histogram gets a summary line
+  * with its count, mean and maximum in ns, followed by a line for each
+  * non-empty bucket with its lower bound in ns and its count. A line
+  * with the name and value of each counter comes last. Values being
+  * recorded while this runs may or may not make it in.
+  * \param path The file to write, replaced through a rename.
+  * \return false if the file couldn't be written.
+  */
+bool stats_dump (const char *path) {
+    char tmp[256];
+    snprintf (tmp, sizeof (tmp), "%s.new", path);
+    FILE *f = fopen (tmp, "w");
+    if (! f) return false;
+
+    for (int i=0; i<STAT_COUNT; ++i) {
+        histogram *h = HIST + i;
+        uint32_t count = __atomic_load_n (&h->count, __ATOMIC_RELAXED);
+        uint64_t sum = __atomic_load_n (&h->sum, __ATOMIC_RELAXED);
+        uint64_t max = __atomic_load_n (&h->max, __ATOMIC_RELAXED);
+        fprintf (f, "%s count %u mean %llu max %llu\n", STAT_NAMES[i],
+                 count, count ? (unsigned long long) (sum / count) : 0ULL,
+                 (unsigned long long) max);
+        for (int b=0; b<STATS_BUCKETS; ++b) {
+            uint32_t n = __atomic_load_n (h->bucket + b, __ATOMIC_RELAXED);
+            if (! n) continue;
+            fprintf (f, "  %llu %u\n", b ? (1ULL << (b-1)) : 0ULL, n);
+        }
+    }
+
+    for (int i=0; i<ncounters; ++i) {
+        fprintf (f, "%s %u\n", COUNTERS[i].name,
+                 __atomic_load_n (COUNTERS[i].value, __ATOMIC_RELAXED));
+    }
+
+    if (fclose (f)) return false;
+    return (rename (tmp, path) == 0);
+}
+
+/** Signal handler, asks for a dump at the next stats_poll() */
+void stats_request_dump (int sig) {
+    dump_requested = 1;
+    signal (sig, stats_request_dump);
+}
+
+/** Write the dump to STATS_PATH if it was asked for. Called regularly
+  * from a thread where file I/O doesn't hurt.
+  */
+void stats_poll (void) {
+    if (! dump_requested) return;
+    dump_requested = 0;
+    stats_dump (STATS_PATH);
+}
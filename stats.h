@@ -0,0 +1,49 @@
+#ifndef _STATS_H
+#define _STATS_H 1
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* =============================== TYPES =============================== */
+
+/** Number of buckets per histogram. Bucket n counts values of at least
+  * 2^(n-1) ns and less than 2^n ns, the last one everything above. */
+#define STATS_BUCKETS 32
+
+/** Number of counters that can be added to the dump */
+#define STATS_COUNTERS 16
+
+/** Where the statistics get written on request */
+#define STATS_PATH "/var/run/triggermagic.stats"
+
+/** Things we measure */
+typedef enum {
+    STAT_MATCH = 0, /**< Input read to trigger matched */
+    STAT_QUEUE, /**< Trigger matched to handled by the engine */
+    STAT_WRITE, /**< Output handed to the writer to written out */
+    STAT_INOUT, /**< Input read to resulting output written out */
+    STAT_STEP, /**< Lateness of sequencer steps against their deadline */
+    STAT_GATE, /**< Lateness of timed note-offs against their deadline */
+    STAT_SYNC, /**< Phase error of sequences against the external clock */
+    STAT_COUNT
+} statid;
+
+/** A histogram with logarithmic buckets. Updated with relaxed atomics
+  * only, so any thread can record into it without taking a lock. */
+typedef struct histogram_s {
+    uint32_t         bucket[STATS_BUCKETS]; /**< Counts per bucket */
+    uint32_t         count; /**< Number of values recorded */
+    uint64_t         sum; /**< Sum of the values, in ns */
+    uint64_t         max; /**< Largest value, in ns */
+} histogram;
+
+/* ============================= FUNCTIONS ============================= */
+
+void         stats_record (statid, uint64_t);
+void         stats_counter (const char *, const uint32_t *);
+void         stats_reset (void);
+bool         stats_dump (const char *);
+void         stats_request_dump (int);
+void         stats_poll (void);
+
+#endif
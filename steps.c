@@ -0,0 +1,105 @@
+#include "steps.h"
+
+/** Add a step to a table.
+  * \param T The trigger the table is compiled from.
+  * \param note The note to play, 0 for a rest.
+  * \param src Position of the note in the trigger, for velocities.
+  */
+static void steps_add (steptable *self, const triggerpreset *T,
+                       char note, int src) {
+    if (self->length >= STEPS_MAX) return;
+    seqstep *s = self->steps + self->length++;
+    s->note = note;
+    s->velocity = 0;
+    s->gate = 0;
+    s->flags = 0;
+    
+    switch (T->vconf) {
+        case VELO_COPY: s->flags |= STEP_VELO_COPY; break;
+        case VELO_INDIVIDUAL: s->velocity = T->velocities[src]; break;
+        case VELO_RND_WIDE: s->flags |= STEP_VELO_RND_WIDE; break;
+        case VELO_RND_NARROW: s->flags |= STEP_VELO_RND_NARROW; break;
+        case VELO_FIXED_64: s->velocity = 64; break;
+        case VELO_FIXED_100: s->velocity = 100; break;
+    }
+    
+    switch (T->sgate) {
+        case SGATE_RND_WIDE: s->flags |= STEP_GATE_RND_WIDE; break;
+        case SGATE_RND_NARROW: s->flags |= STEP_GATE_RND_NARROW; break;
+        default: s->gate = (uint8_t) T->sgate; break;
+    }
+}
+
+/** Compile the full cycle of a trigger's sequence into a step table.
+  * The notes are first expanded over the octave range, then laid out
+  * in the order of the move pattern. For MOVE_LOOP_RANDOM, the table
+  * holds the expanded notes, and the position is picked at runtime.
+  */
+void steps_compile (steptable *self, const triggerpreset *T) {
+    char notes[8*3];
+    uint8_t src[8*3];
+    int count = T->lastnote + 1;
+    int octaves = 1;
+    int len = 0;
+    
+    if (count < 1) count = 1;
+    if (count > 8) count = 8;
+    if (T->range == RANGE_1_OCT) octaves = 2;
+    else if (T->range == RANGE_2_OCT) octaves = 3;
+    
+    for (int o=0; o<octaves; ++o) {
+        for (int i=0; i<count; ++i) {
+            int note = T->notes[i];
+            if (note) {
+                note += 12*o;
+                while (note > 127) note -= 12;
+            }
+            notes[len] = (char) note;
+            src[len] = i;
+            len++;
+        }
+    }
+    
+    self->length = 0;
+    self->single = (T->move == MOVE_SINGLE);
+    self->random = (T->move == MOVE_LOOP_RANDOM);
+    
+    switch (T->move) {
+        case MOVE_SINGLE:
+        case MOVE_LOOP_UP:
+        case MOVE_LOOP_RANDOM:
+            for (int i=0; i<len; ++i) steps_add (self, T, notes[i], src[i]);
+            break;
+        
+        case MOVE_LOOP_DOWN:
+            for (int i=len-1; i>=0; --i) {
+                steps_add (self, T, notes[i], src[i]);
+            }
+            break;
+        
+        case MOVE_LOOP_UPDOWN:
+            for (int i=0; i<len; ++i) steps_add (self, T, notes[i], src[i]);
+            for (int i=len-2; i>0; --i) {
+                steps_add (self, T, notes[i], src[i]);
+            }
+            break;
+        
+        case MOVE_LOOP_STEPUP: /* 123 234 345 ... 812 */
+            for (int i=0; i<len; ++i) {
+                for (int j=0; j<3; ++j) {
+                    int p = (i+j) % len;
+                    steps_add (self, T, notes[p], src[p]);
+                }
+            }
+            break;
+        
+        case MOVE_LOOP_STEPDOWN: /* 876 765 654 ... 187 */
+            for (int i=0; i<len; ++i) {
+                for (int j=0; j<3; ++j) {
+                    int p = (3*len - 1 - i - j) % len;
+                    steps_add (self, T, notes[p], src[p]);
+                }
+            }
+            break;
+    }
+}
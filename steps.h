@@ -0,0 +1,10 @@
+#ifndef _STEPS_H
+#define _STEPS_H 1
+
+#include "presets.h"
+
+/* ============================= FUNCTIONS ============================= */
+
+void         steps_compile (steptable *, const triggerpreset *);
+
+#endif
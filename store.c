@@ -0,0 +1,644 @@
+#include "store.h"
+#include "thread.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <libgen.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/** Preset library. Presets are kept in banks of STORE_BANKPRESETS, in a
+  * single file that is mapped read only. Loading a preset only touches
+  * the pages of its own record, so neither startup time nor memory use
+  * grows with the size of the library. Every record has a fixed place,
+  * given by its bank and number, and starts with the preset's name, so
+  * the file is its own index: browsing names reads just those.
+  *
+  * Records are encoded field by field, little endian, so the file
+  * doesn't depend on the layout of the preset struct or on the machine.
+  * A preset that was never stored has no record, and reads as missing.
+  * The file grows a bank at a time, as presets get stored in banks it
+  * doesn't have yet.
+  *
+  * Every preset has two record slots, each holding a generation number
+  * and a checksum along with the preset. A store writes the slot with
+  * the older generation and syncs it, so power loss halfway through a
+  * write only ever hits the copy being replaced, and the other one is
+  * still there to load. Writes happen on an I/O thread of their own, so
+  * the UI doesn't wait for the SD card.
+  *
+  * On open, files in older formats get converted into bank 1, leaving
+  * out presets that were never used. A damaged header gets rebuilt, as
+  * long as the file still holds intact records, which can be told from
+  * garbage by their own checksum, bank and number. A file that can't be
+  * made sense of at all is kept next to a new, empty one, with .bad
+  * added to its name.
+  *
+  * File layout:
+  *
+  *     0     "TMPB", then version, presets per bank, record size and
+  *           slot size, and a CRC-32 of all that, all 32 bit
+  *     512   Bank 1, two slots of STORE_SLOTSIZE per preset
+  *     ...   Further banks, STORE_BANKSIZE each
+  */
+
+/** Size of the header, the first bank starts at STORE_ALIGN */
+#define STORE_HEADSIZE 24
+
+/** Slots are a multiple of this, so a torn write can't reach into a
+  * neighbouring record */
+#define STORE_ALIGN 512
+
+/** Size of an encoded trigger */
+#define STORE_TRIGSIZE 50
+
+/** Offset of the name in a record */
+#define STORE_NAMEPOS 12
+
+/** Size of an encoded record: generation, checksum, bank, number and
+  * name, the triggers, then tempo, seqmode, tempo_frac and padding */
+#define STORE_RECSIZE (STORE_NAMEPOS + 16 + 12*STORE_TRIGSIZE + 33)
+
+/** Size of a record slot */
+#define STORE_SLOTSIZE \
+    (((STORE_RECSIZE + STORE_ALIGN - 1) / STORE_ALIGN) * STORE_ALIGN)
+
+/** Size of a bank */
+#define STORE_BANKSIZE ((off_t) STORE_BANKPRESETS * 2 * STORE_SLOTSIZE)
+
+/** Older formats a library gets converted from */
+typedef enum {
+    LEGACY_NONE, /**< Nothing to convert */
+    LEGACY_SHORT, /**< Dump of 100 presets from before seqmode was added */
+    LEGACY_DUMP /**< Dump of 100 presets */
+} storelegacy;
+
+/** A write waiting for the I/O thread */
+typedef struct storejob_s {
+    int              bank; /**< Bank number */
+    int              nr; /**< Preset number */
+    preset           data; /**< Preset to write */
+} storejob;
+
+/** Store state */
+static struct storestate {
+    int              fd; /**< Store file, -1 if it couldn't be opened */
+    const uint8_t   *map; /**< The file, mapped read only */
+    size_t           maplen; /**< Size of the mapping */
+    int              banks; /**< Number of banks in the mapping */
+    pthread_mutex_t  lock; /**< Lock on the pending writes */
+    storejob         pending[STORE_PENDING]; /**< Pending writes */
+    int              npending; /**< Number of pending writes */
+    storejob         writing; /**< Write in progress */
+    bool             busy; /**< True while the I/O thread writes */
+    conditional      wake; /**< Wakes up the I/O thread */
+    conditional      done; /**< Signalled when the I/O thread goes idle */
+    thread          *io; /**< The I/O thread */
+} self = { .fd = -1 };
+
+/** Update a CRC-32 (IEEE 802.3, as used by zlib) with a block of data.
+  * Start with 0.
+  */
+uint32_t store_crc (uint32_t crc, const void *data, size_t sz) {
+    const uint8_t *p = (const uint8_t *) data;
+    crc = ~crc;
+    while (sz--) {
+        crc ^= *p++;
+        for (int i=0; i<8; ++i) crc = (crc >> 1) ^ (0xedb88320 & -(crc & 1));
+    }
+    return ~crc;
+}
+
+static void store_put8 (uint8_t **p, uint32_t v) {
+    *(*p)++ = v;
+}
+
+static void store_put16 (uint8_t **p, uint32_t v) {
+    store_put8 (p, v);
+    store_put8 (p, v >> 8);
+}
+
+static void store_put32 (uint8_t **p, uint32_t v) {
+    store_put16 (p, v);
+    store_put16 (p, v >> 16);
+}
+
+static void store_putbytes (uint8_t **p, const void *src, size_t sz) {
+    memcpy (*p, src, sz);
+    *p += sz;
+}
+
+static uint32_t store_get8 (const uint8_t **p) {
+    return *(*p)++;
+}
+
+static uint32_t store_get16 (const uint8_t **p) {
+    uint32_t v = store_get8 (p);
+    return v | store_get8 (p) << 8;
+}
+
+static uint32_t store_get32 (const uint8_t **p) {
+    uint32_t v = store_get16 (p);
+    return v | store_get16 (p) << 16;
+}
+
+static void store_getbytes (const uint8_t **p, void *dst, size_t sz) {
+    memcpy (dst, *p, sz);
+    *p += sz;
+}
+
+/** Returns the checksum of an encoded record, which covers everything
+  * but the checksum itself */
+static uint32_t store_reccrc (const uint8_t *rec) {
+    return store_crc (store_crc (0, rec, 4), rec + 8, STORE_RECSIZE - 8);
+}
+
+/** Encode a preset into a record */
+static void store_encode (uint8_t *rec, int bank, int nr, uint32_t gen,
+                          const preset *ps) {
+    uint8_t *p = rec;
+    store_put32 (&p, gen);
+    store_put32 (&p, 0);
+    store_put16 (&p, bank);
+    store_put16 (&p, nr);
+    store_putbytes (&p, ps->name, 16);
+    for (int i=0; i<12; ++i) {
+        const triggerpreset *t = ps->triggers + i;
+        store_putbytes (&p, t->notes, 8);
+        store_put32 (&p, t->lastnote);
+        store_put8 (&p, t->vconf);
+        store_putbytes (&p, t->velocities, 8);
+        store_put8 (&p, t->send);
+        store_put8 (&p, t->nmode);
+        store_put32 (&p, t->slen);
+        store_put8 (&p, t->sgate);
+        store_put8 (&p, t->range);
+        store_put8 (&p, t->move);
+        store_put8 (&p, t->port);
+        store_put8 (&p, t->channel);
+        store_putbytes (&p, t->pad, sizeof (t->pad));
+    }
+    store_put32 (&p, ps->tempo);
+    store_put8 (&p, ps->seqmode);
+    store_put8 (&p, ps->tempo_frac);
+    store_putbytes (&p, ps->pad, sizeof (ps->pad));
+    p = rec + 4;
+    store_put32 (&p, store_reccrc (rec));
+}
+
+/** Decode a preset from a record */
+static void store_decode (const uint8_t *rec, preset *ps) {
+    const uint8_t *p = rec + STORE_NAMEPOS;
+    memset (ps, 0, sizeof (preset));
+    store_getbytes (&p, ps->name, 16);
+    ps->name[15] = 0;
+    for (int i=0; i<12; ++i) {
+        triggerpreset *t = ps->triggers + i;
+        store_getbytes (&p, t->notes, 8);
+        t->lastnote = (int32_t) store_get32 (&p);
+        t->vconf = (velocityconfig) store_get8 (&p);
+        store_getbytes (&p, t->velocities, 8);
+        t->send = (sendconfig) store_get8 (&p);
+        t->nmode = (notemode) store_get8 (&p);
+        t->slen = (int32_t) store_get32 (&p);
+        t->sgate = (gateconfig) store_get8 (&p);
+        t->range = (sequencerange) store_get8 (&p);
+        t->move = (movetype) store_get8 (&p);
+        t->port = store_get8 (&p);
+        t->channel = store_get8 (&p);
+        store_getbytes (&p, t->pad, sizeof (t->pad));
+    }
+    ps->tempo = (int32_t) store_get32 (&p);
+    ps->seqmode = (seqmode) store_get8 (&p);
+    ps->tempo_frac = store_get8 (&p);
+    store_getbytes (&p, ps->pad, sizeof (ps->pad));
+}
+
+/** Check a record slot.
+  * \return The generation of the record, 0 if the slot is empty or
+  *         damaged, or holds another preset.
+  */
+static uint32_t store_valid (const uint8_t *rec, int bank, int nr) {
+    const uint8_t *p = rec;
+    uint32_t gen = store_get32 (&p);
+    uint32_t crc = store_get32 (&p);
+    if (! gen || crc != store_reccrc (rec)) return 0;
+    if (store_get16 (&p) != (uint32_t) bank) return 0;
+    if (store_get16 (&p) != (uint32_t) nr) return 0;
+    return gen;
+}
+
+/** Pick the newest intact record out of the two slots of a preset.
+  * \return Its generation, 0 if neither is intact.
+  */
+static uint32_t store_newest (const uint8_t *a, const uint8_t *b,
+                              int bank, int nr, int *slot) {
+    uint32_t ga = store_valid (a, bank, nr);
+    uint32_t gb = store_valid (b, bank, nr);
+    *slot = (gb > ga);
+    return gb > ga ? gb : ga;
+}
+
+/** Returns the file offset of a record slot */
+static off_t store_offset (int bank, int nr, int slot) {
+    return STORE_ALIGN + (off_t) (bank-1) * STORE_BANKSIZE +
+           (off_t) ((nr-1)*2 + slot) * STORE_SLOTSIZE;
+}
+
+/** Fill in a header for the current format, padded to STORE_ALIGN */
+static void store_head (uint8_t *h) {
+    uint8_t *p = h;
+    memset (h, 0, STORE_ALIGN);
+    store_putbytes (&p, "TMPB", 4);
+    store_put32 (&p, STORE_VERSION);
+    store_put32 (&p, STORE_BANKPRESETS);
+    store_put32 (&p, STORE_RECSIZE);
+    store_put32 (&p, STORE_SLOTSIZE);
+    store_put32 (&p, store_crc (0, h, p - h));
+}
+
+/** Write a whole buffer at an offset.
+  * \return false on error.
+  */
+static bool store_pwrite (int fd, const void *buf, size_t sz, off_t at) {
+    const char *p = (const char *) buf;
+    while (sz) {
+        ssize_t res = pwrite (fd, p, sz, at);
+        if (res < 0 && errno == EINTR) continue;
+        if (res <= 0) return false;
+        p += res;
+        sz -= res;
+        at += res;
+    }
+    return true;
+}
+
+/** Sync the directory a file is in, so a rename into it sticks */
+static void store_sync_dir (const char *path) {
+    char dir[256];
+    snprintf (dir, sizeof (dir), "%s", path);
+    int fd = open (dirname (dir), O_RDONLY);
+    if (fd < 0) return;
+    fsync (fd);
+    close (fd);
+}
+
+/** Find out which older format a file is in, going by its size.
+  * \return LEGACY_NONE if it is in none of them.
+  */
+static storelegacy store_legacy_kind (off_t fsize) {
+    if (fsize == (off_t) (100 * offsetof (preset, seqmode))) {
+        return LEGACY_SHORT;
+    }
+    if (fsize == (off_t) (100 * sizeof (preset))) return LEGACY_DUMP;
+    return LEGACY_NONE;
+}
+
+/** Read a preset from a file in an older format. The old formats had
+  * room for every preset, those never used are all zeroes.
+  * \return false if it isn't there, or was never used.
+  */
+static bool store_read_legacy (int fd, storelegacy kind, int nr,
+                               preset *p) {
+    size_t oldsize = offsetof (preset, seqmode);
+    size_t sz = (kind == LEGACY_SHORT) ? oldsize : sizeof (preset);
+    if (kind == LEGACY_NONE) return false;
+    memset (p, 0, sizeof (preset));
+    if (pread (fd, p, sz, nr*sz) != (ssize_t) sz) return false;
+    const uint8_t *b = (const uint8_t *) p;
+    for (size_t i=0; i<sz; ++i) if (b[i]) return true;
+    return false;
+}
+
+/** Write a new store file next to the real one, then move it in place.
+  * Presets from a file in an older format go in bank 1, in the first
+  * slot, as generation 1.
+  * \param from The old file, if kind isn't LEGACY_NONE.
+  * \return false if that failed, the old file is still there then.
+  */
+static bool store_create (const char *path, int from, storelegacy kind) {
+    static uint8_t block[STORE_SLOTSIZE];
+    char tmp[256];
+    snprintf (tmp, sizeof (tmp), "%s.new", path);
+    int fd = open (tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return false;
+
+    store_head (block);
+    bool ok = store_pwrite (fd, block, STORE_ALIGN, 0);
+    if (kind != LEGACY_NONE) {
+        preset p;
+        if (ok) ok = (ftruncate (fd, STORE_ALIGN + STORE_BANKSIZE) == 0);
+        for (int nr=1; ok && nr<=STORE_BANKPRESETS; ++nr) {
+            if (! store_read_legacy (from, kind, nr, &p)) continue;
+            memset (block, 0, sizeof (block));
+            store_encode (block, 1, nr, 1, &p);
+            ok = store_pwrite (fd, block, STORE_SLOTSIZE,
+                               store_offset (1, nr, 0));
+        }
+    }
+    if (ok) ok = (fsync (fd) == 0);
+    close (fd);
+    if (ok) ok = (rename (tmp, path) == 0);
+    if (! ok) {
+        unlink (tmp);
+        return false;
+    }
+    store_sync_dir (path);
+    return true;
+}
+
+/** Find out how many intact records a file with a damaged header
+  * still holds.
+  * \param banks Gets the number of banks the file reaches into.
+  */
+static int store_intact (int fd, off_t fsize, int *banks) {
+    static uint8_t rec[STORE_RECSIZE];
+    int count = 0;
+    off_t n = (fsize - STORE_ALIGN + STORE_BANKSIZE - 1) / STORE_BANKSIZE;
+    *banks = (fsize <= STORE_ALIGN) ? 0 : (n > STORE_BANKS) ? STORE_BANKS
+                                                            : (int) n;
+    for (int bank=1; bank<=*banks; ++bank) {
+        for (int nr=1; nr<=STORE_BANKPRESETS; ++nr) {
+            for (int slot=0; slot<2; ++slot) {
+                off_t at = store_offset (bank, nr, slot);
+                if (pread (fd, rec, sizeof (rec), at) != sizeof (rec)) {
+                    continue;
+                }
+                if (store_valid (rec, bank, nr)) count++;
+            }
+        }
+    }
+    return count;
+}
+
+/** Put a new header on a file, and make it span whole banks again.
+  * \return false if that failed.
+  */
+static bool store_reheader (const char *path, off_t fsize, int banks) {
+    uint8_t h[STORE_ALIGN];
+    int fd = open (path, O_WRONLY);
+    if (fd < 0) return false;
+    store_head (h);
+    off_t end = STORE_ALIGN + (off_t) banks * STORE_BANKSIZE;
+    bool ok = store_pwrite (fd, h, sizeof (h), 0);
+    if (ok && fsize < end) ok = (ftruncate (fd, end) == 0);
+    if (ok) ok = (fsync (fd) == 0);
+    close (fd);
+    return ok;
+}
+
+/** Make sure the store file is in the current format. Converts files
+  * in older formats, rebuilds a damaged header, and starts an empty
+  * library if there is no file, or one that can't be made sense of.
+  * \return false if the file couldn't be read, or converted.
+  */
+static bool store_load (const char *path) {
+    int fd = open (path, O_RDONLY);
+    if (fd < 0) {
+        if (errno != ENOENT) return false;
+        return store_create (path, -1, LEGACY_NONE);
+    }
+
+    struct stat st;
+    uint8_t h[STORE_HEADSIZE], want[STORE_ALIGN];
+    store_head (want);
+    if (fstat (fd, &st) != 0) st.st_size = 0;
+    if (pread (fd, h, sizeof (h), 0) == sizeof (h) &&
+        memcmp (h, want, sizeof (h)) == 0) {
+        close (fd);
+        return true;
+    }
+
+    bool res = true;
+    int banks;
+    storelegacy kind = store_legacy_kind (st.st_size);
+    if (kind != LEGACY_NONE) {
+        res = store_create (path, fd, kind);
+        if (! res) fprintf (stderr, "store: can't convert %s\n", path);
+    }
+    else if (store_intact (fd, st.st_size, &banks)) {
+        fprintf (stderr, "store: %s has a damaged header, rebuilding\n",
+                 path);
+        res = store_reheader (path, st.st_size, banks);
+    }
+    else {
+        char bad[256];
+        snprintf (bad, sizeof (bad), "%s.bad", path);
+        fprintf (stderr, "store: %s not readable, kept as %s\n", path, bad);
+        rename (path, bad);
+        store_create (path, -1, LEGACY_NONE);
+        res = false;
+    }
+    close (fd);
+    return res;
+}
+
+/** Map the store file, again if it grew since it was last mapped. The
+  * mapping is kept out of the process' locked memory. Reader side only.
+  */
+static void store_map (void) {
+    struct stat st;
+    if (self.fd < 0 || fstat (self.fd, &st) != 0) return;
+    if ((size_t) st.st_size == self.maplen) return;
+    if (self.map) munmap ((void *) self.map, self.maplen);
+    self.map = NULL;
+    self.maplen = 0;
+    self.banks = 0;
+    if (st.st_size < STORE_ALIGN) return;
+    void *map = mmap (NULL, st.st_size, PROT_READ, MAP_SHARED, self.fd, 0);
+    if (map == MAP_FAILED) return;
+    /* The process locks its memory for the MIDI threads, which don't
+       need the library. Unlocked, its pages only come in as records get
+       read, and the kernel is free to drop them again */
+    munlock (map, st.st_size);
+    self.map = (const uint8_t *) map;
+    self.maplen = st.st_size;
+    off_t banks = (st.st_size - STORE_ALIGN) / STORE_BANKSIZE;
+    self.banks = (banks > STORE_BANKS) ? STORE_BANKS : banks;
+}
+
+/** Look for a preset among the writes that haven't made it to the file
+  * yet.
+  * \return false if it isn't there.
+  */
+static bool store_queued (int bank, int nr, preset *p) {
+    bool found = false;
+    pthread_mutex_lock (&self.lock);
+    for (int i=0; i<self.npending && ! found; ++i) {
+        const storejob *j = self.pending + i;
+        if (j->bank != bank || j->nr != nr) continue;
+        memcpy (p, &j->data, sizeof (preset));
+        found = true;
+    }
+    if (! found && self.busy && self.writing.bank == bank &&
+        self.writing.nr == nr) {
+        memcpy (p, &self.writing.data, sizeof (preset));
+        found = true;
+    }
+    pthread_mutex_unlock (&self.lock);
+    return found;
+}
+
+/** Returns the newest intact record of a preset in the mapped file,
+  * NULL if it has none.
+  */
+static const uint8_t *store_find (int bank, int nr) {
+    if (bank > self.banks) store_map();
+    if (bank > self.banks) return NULL;
+    const uint8_t *a = self.map + store_offset (bank, nr, 0);
+    const uint8_t *b = a + STORE_SLOTSIZE;
+    int slot;
+    if (store_newest (a, b, bank, nr, &slot)) return slot ? b : a;
+    if (a[0] | a[1] | a[2] | a[3] | b[0] | b[1] | b[2] | b[3]) {
+        fprintf (stderr, "store: preset %i.%02i damaged\n", bank, nr);
+    }
+    return NULL;
+}
+
+/** Write a preset to the slot that doesn't have its newest intact copy.
+  * Grows the file by a bank if needed. I/O thread only.
+  */
+static bool store_put (const storejob *j) {
+    static uint8_t slots[2][STORE_SLOTSIZE];
+    off_t at = store_offset (j->bank, j->nr, 0);
+    off_t end = STORE_ALIGN + (off_t) j->bank * STORE_BANKSIZE;
+    struct stat st;
+    if (self.fd < 0 || fstat (self.fd, &st) != 0) return false;
+    if (st.st_size < end && ftruncate (self.fd, end) != 0) return false;
+
+    int slot = 0;
+    uint32_t gen = 0;
+    if (pread (self.fd, slots, sizeof (slots), at) == sizeof (slots)) {
+        gen = store_newest (slots[0], slots[1], j->bank, j->nr, &slot);
+    }
+    if (gen) slot ^= 1;
+    memset (slots[0], 0, STORE_SLOTSIZE);
+    store_encode (slots[0], j->bank, j->nr, gen + 1, &j->data);
+    return store_pwrite (self.fd, slots[0], STORE_SLOTSIZE,
+                         at + slot * STORE_SLOTSIZE) &&
+           fdatasync (self.fd) == 0;
+}
+
+/** I/O thread. Writes pending presets, oldest first. */
+static void store_thread (thread *t) {
+    while (1) {
+        conditional_wait (&self.wake);
+        pthread_mutex_lock (&self.lock);
+        while (self.npending) {
+            memcpy (&self.writing, self.pending, sizeof (storejob));
+            self.npending--;
+            memmove (self.pending, self.pending+1,
+                     self.npending * sizeof (storejob));
+            self.busy = true;
+            pthread_mutex_unlock (&self.lock);
+            if (! store_put (&self.writing)) {
+                fprintf (stderr, "store: can't write preset %i.%02i: %s\n",
+                         self.writing.bank, self.writing.nr,
+                         strerror (errno));
+            }
+            pthread_mutex_lock (&self.lock);
+            self.busy = false;
+        }
+        pthread_mutex_unlock (&self.lock);
+        conditional_signal (&self.done);
+    }
+}
+
+/** Open the preset library, and start the I/O thread that writes to it.
+  * Reading from the library is for a single thread, the one that also
+  * stores presets.
+  * \param path The store file, created or converted if needed.
+  * \return false if the file couldn't be read, or converted.
+  */
+bool store_open (const char *path) {
+    bool res = store_load (path);
+    self.fd = open (path, O_RDWR);
+    if (self.fd < 0) fprintf (stderr, "store: can't open %s\n", path);
+    store_map();
+    pthread_mutex_init (&self.lock, NULL);
+    conditional_init (&self.wake);
+    conditional_init (&self.done);
+    self.npending = 0;
+    self.busy = false;
+    self.io = thread_create (THREAD_IO, store_thread, NULL);
+    return res;
+}
+
+/** Load a preset from the library, decoding just that one record.
+  * \param bank The bank number (1-STORE_BANKS).
+  * \param nr The preset number (1-STORE_BANKPRESETS).
+  * \param p Gets the preset.
+  * \return false if the preset was never stored, or is damaged. Its
+  *         defaults are up to the caller then.
+  */
+bool store_read (int bank, int nr, preset *p) {
+    if (bank < 1 || bank > STORE_BANKS) return false;
+    if (nr < 1 || nr > STORE_BANKPRESETS) return false;
+    if (store_queued (bank, nr, p)) return true;
+    const uint8_t *rec = store_find (bank, nr);
+    if (! rec) return false;
+    store_decode (rec, p);
+    return true;
+}
+
+/** Get the name of a preset in the library, without loading it.
+  * \param name Gets the name, 16 bytes.
+  * \return false if the preset was never stored, or is damaged.
+  */
+bool store_name (int bank, int nr, char *name) {
+    preset p;
+    if (bank < 1 || bank > STORE_BANKS) return false;
+    if (nr < 1 || nr > STORE_BANKPRESETS) return false;
+    if (store_queued (bank, nr, &p)) {
+        memcpy (name, p.name, 16);
+    }
+    else {
+        const uint8_t *rec = store_find (bank, nr);
+        if (! rec) return false;
+        memcpy (name, rec + STORE_NAMEPOS, 16);
+    }
+    name[15] = 0;
+    return true;
+}
+
+/** Have a preset written by the I/O thread. Doesn't wait for it, unless
+  * there are too many writes waiting already.
+  * \param bank The bank number (1-STORE_BANKS).
+  * \param nr The preset number (1-STORE_BANKPRESETS).
+  * \param p The preset, copied right away.
+  */
+void store_write (int bank, int nr, const preset *p) {
+    if (bank < 1 || bank > STORE_BANKS) return;
+    if (nr < 1 || nr > STORE_BANKPRESETS) return;
+    pthread_mutex_lock (&self.lock);
+    int i = 0;
+    while (i < self.npending && (self.pending[i].bank != bank ||
+                                 self.pending[i].nr != nr)) i++;
+    while (i == STORE_PENDING) {
+        pthread_mutex_unlock (&self.lock);
+        store_flush();
+        pthread_mutex_lock (&self.lock);
+        i = self.npending;
+    }
+    if (i == self.npending) self.npending++;
+    self.pending[i].bank = bank;
+    self.pending[i].nr = nr;
+    memcpy (&self.pending[i].data, p, sizeof (preset));
+    pthread_mutex_unlock (&self.lock);
+    conditional_signal (&self.wake);
+}
+
+/** Wait until all pending writes are on disk */
+void store_flush (void) {
+    while (1) {
+        pthread_mutex_lock (&self.lock);
+        bool idle = ! self.npending && ! self.busy;
+        pthread_mutex_unlock (&self.lock);
+        if (idle || ! self.io) return;
+        conditional_wait (&self.done);
+    }
+}
@@ -0,0 +1,33 @@
+#ifndef _STORE_H
+#define _STORE_H 1
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "presets.h"
+
+/* =============================== TYPES =============================== */
+
+/** Number of banks in a preset library */
+#define STORE_BANKS 99
+
+/** Number of presets in a bank, numbered from 1 */
+#define STORE_BANKPRESETS 99
+
+/** Store file format version */
+#define STORE_VERSION 2
+
+/** Writes that can wait for the I/O thread. Storing a preset that is
+  * already waiting replaces it. */
+#define STORE_PENDING 8
+
+/* ============================= FUNCTIONS ============================= */
+
+bool         store_open (const char *);
+bool         store_read (int, int, preset *);
+bool         store_name (int, int, char *);
+void         store_write (int, int, const preset *);
+void         store_flush (void);
+uint32_t     store_crc (uint32_t, const void *, size_t);
+
+#endif
@@ -0,0 +1,114 @@
+#include "tempo.h"
+#include "thread.h"
+
+/** Multiply two 64 bit numbers into a 128 bit result. Done on 32 bit
+  * halves, so it works the same on 32 bit targets.
+  */
+static void tempo_mul (uint64_t a, uint64_t b, uint64_t *hi, uint64_t *lo) {
+    uint64_t al = a & 0xffffffffULL, ah = a >> 32;
+    uint64_t bl = b & 0xffffffffULL, bh = b >> 32;
+    uint64_t ll = al * bl;
+    uint64_t lh = al * bh;
+    uint64_t hl = ah * bl;
+    uint64_t mid = (ll >> 32) + (lh & 0xffffffffULL) + (hl & 0xffffffffULL);
+    *lo = (mid << 32) | (ll & 0xffffffffULL);
+    *hi = ah * bh + (lh >> 32) + (hl >> 32) + (mid >> 32);
+}
+
+/** Divide a 128 bit number by a 64 bit one. The quotient has to fit in
+  * 64 bits, which holds as long as hi < d.
+  */
+static uint64_t tempo_div (uint64_t hi, uint64_t lo, uint64_t d) {
+    uint64_t q = 0;
+    for (int i=0; i<64; ++i) {
+        bool carry = (hi >> 63);
+        hi = (hi << 1) | (lo >> 63);
+        lo <<= 1;
+        q <<= 1;
+        if (carry || hi >= d) {
+            hi -= d;
+            q |= 1;
+        }
+    }
+    return q;
+}
+
+/** Returns the beat length for a tempo, in ns (Q32.32) */
+static uint64_t tempo_period (uint32_t centibpm) {
+    if (centibpm < TEMPO_MIN) centibpm = TEMPO_MIN;
+    if (centibpm > TEMPO_MAX) centibpm = TEMPO_MAX;
+    uint64_t minute = 60ULL * 100ULL * CLOCK_SEC;
+    uint64_t whole = minute / centibpm;
+    uint64_t frac = ((minute % centibpm) << 32) / centibpm;
+    return (whole << 32) | frac;
+}
+
+/** Initialize a tempo map with beat position 0 at the given time.
+  * \param now The time of beat 0.
+  * \param centibpm The tempo in 1/100 BPM.
+  */
+void tempo_init (tempo *self, uint64_t now, uint32_t centibpm) {
+    self->anchor = now;
+    self->phase = 0;
+    self->period = tempo_period (centibpm);
+    self->centibpm = centibpm;
+}
+
+/** Move the anchor to a new point, keeping the phase it has there */
+static void tempo_reanchor (tempo *self, uint64_t when) {
+    self->phase = tempo_pos (self, when);
+    self->anchor = when;
+}
+
+/** Change the tempo from a point in time onwards.
+  * \param when The time the change takes effect.
+  * \param centibpm The new tempo in 1/100 BPM.
+  */
+void tempo_set_bpm (tempo *self, uint64_t when, uint32_t centibpm) {
+    if (centibpm == self->centibpm) return;
+    tempo_reanchor (self, when);
+    self->period = tempo_period (centibpm);
+    self->centibpm = centibpm;
+}
+
+/** Change the beat length from a point in time onwards. Used to follow
+  * a measured tempo.
+  * \param when The time the change takes effect.
+  * \param ns The new beat length in ns.
+  */
+void tempo_set_period (tempo *self, uint64_t when, uint64_t ns) {
+    if (! ns || (ns << 32) == self->period) return;
+    tempo_reanchor (self, when);
+    self->period = ns << 32;
+    self->centibpm = 0;
+}
+
+/** Returns the time of a beat position, rounded to the nearest ns.
+  * Worked out from the anchor every time, the error stays below a ns
+  * however far away the position is.
+  */
+uint64_t tempo_time (const tempo *self, uint64_t pos) {
+    uint64_t hi, lo;
+    if (pos >= self->phase) {
+        tempo_mul (pos - self->phase, self->period, &hi, &lo);
+        return self->anchor + hi + (lo >> 63);
+    }
+    tempo_mul (self->phase - pos, self->period, &hi, &lo);
+    hi += (lo >> 63);
+    return (hi < self->anchor) ? self->anchor - hi : 0;
+}
+
+/** Returns the beat position at a point in time (Q32.32) */
+uint64_t tempo_pos (const tempo *self, uint64_t when) {
+    if (! self->period) return 0;
+    if (when >= self->anchor) {
+        return self->phase + tempo_div (when - self->anchor, 0, self->period);
+    }
+    uint64_t back = tempo_div (self->anchor - when, 0, self->period);
+    return (back < self->phase) ? self->phase - back : 0;
+}
+
+/** Returns the current beat length in ns */
+uint64_t tempo_beat_ns (const tempo *self) {
+    return (self->period + (1ULL << 31)) >> 32;
+}
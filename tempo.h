@@ -0,0 +1,38 @@
+#ifndef _TEMPO_H
+#define _TEMPO_H 1
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* =============================== TYPES =============================== */
+
+/** One beat in fixed-point beat positions (Q32.32) */
+#define TEMPO_BEAT (1ULL << 32)
+
+/** Tempo range in 1/100 BPM */
+#define TEMPO_MIN 4100
+#define TEMPO_MAX 25700
+
+/** Maps between getclock() time and a fixed-point beat position. The
+  * beat position at the anchor point is the phase, times and positions
+  * elsewhere are worked out from it in closed form, so nothing drifts
+  * no matter how many steps are taken. A tempo change moves the anchor
+  * to the point of the change, with the phase it had at that point.
+  */
+typedef struct tempo_s {
+    uint64_t         anchor; /**< getclock() time of the anchor point */
+    uint64_t         phase; /**< Beat position at the anchor (Q32.32) */
+    uint64_t         period; /**< Length of a beat in ns (Q32.32) */
+    uint32_t         centibpm; /**< Tempo in 1/100 BPM, 0 if set by period */
+} tempo;
+
+/* ============================= FUNCTIONS ============================= */
+
+void         tempo_init (tempo *, uint64_t, uint32_t);
+void         tempo_set_bpm (tempo *, uint64_t, uint32_t);
+void         tempo_set_period (tempo *, uint64_t, uint64_t);
+uint64_t     tempo_time (const tempo *, uint64_t);
+uint64_t     tempo_pos (const tempo *, uint64_t);
+uint64_t     tempo_beat_ns (const tempo *);
+
+#endif
@@ -1,6 +1,193 @@
+#define _GNU_SOURCE
 #include "thread.h"
 #include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
 #include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+
+/** Stack size of every thread. Kept small, as all of it gets locked
+  * into memory. */
+#define THREAD_STACK (256 * 1024)
+
+/** Amount of stack touched when a thread starts, so it doesn't take
+  * page faults on it later */
+#define THREAD_PREFAULT (64 * 1024)
+
+/** Scheduling settings for the threads of a role */
+typedef struct threadconfig_s {
+    const char      *name; /**< Name used in reports */
+    int              policy; /**< Scheduling policy */
+    int              priority; /**< Priority for realtime policies */
+    bool             isolate; /**< True to run on the realtime CPU */
+} threadconfig;
+
+/** Scheduling settings per role. The engine has to meet its deadlines,
+  * then the writer has to deliver what it rendered, and input can wait
+  * the longest. The UI and file writes don't need anything special.
+  */
+static const threadconfig ROLES[THREAD_ROLES] = {
+    [THREAD_UI]       = { "ui",       SCHED_OTHER,  0, false },
+    [THREAD_MIDI_IN]  = { "midi-in",  SCHED_FIFO,  70, true },
+    [THREAD_ENGINE]   = { "engine",   SCHED_FIFO,  80, true },
+    [THREAD_MIDI_OUT] = { "midi-out", SCHED_FIFO,  75, true },
+    [THREAD_IO]       = { "io",       SCHED_OTHER,  0, false }
+};
+
+/** Process-wide realtime setup, and what came of it */
+static struct rtstate {
+    bool             locked; /**< True if memory is locked */
+    int              ncpu; /**< Number of online CPUs */
+    int              rtcpu; /**< CPU for realtime threads, -1 for any */
+    int              wanted; /**< Threads that asked for a realtime policy */
+    int              granted; /**< Threads that got it */
+} RT = { false, 1, -1, 0, 0 };
+
+/** Time source that replaces the system clock, NULL for none */
+static clock_f clocksource = NULL;
+
+/** Return the current time in nanoseconds since boot. Uses
+  * CLOCK_MONOTONIC, so that deadlines can be handed to timed waits
+  * as-is. Returns the time of a replacement source instead, if one is
+  * set with thread_set_clock().
+  */
+uint64_t getclock (void) {
+    if (clocksource) return clocksource();
+    struct timespec ts;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return ((ts.tv_sec * CLOCK_SEC) + ts.tv_nsec);
+}
+
+/** Replace the system clock behind getclock(), for running against a
+  * simulated clock. Has to be set before anything reads the clock.
+  * \param source The new time source, NULL for the system clock.
+  */
+void thread_set_clock (clock_f source) {
+    clocksource = source;
+}
+
+/** Pick the CPU for realtime threads. That's the last CPU isolated from
+  * the scheduler with isolcpus=, or else the last CPU, as long as there
+  * is another one left for everything else.
+  */
+static int thread_pick_rtcpu (int ncpu) {
+    char buf[128];
+    int res = -1;
+    FILE *f = fopen ("/sys/devices/system/cpu/isolated", "r");
+    if (f) {
+        if (fgets (buf, sizeof (buf), f)) {
+            /* A list like "3", "2-3" or "1,3", take the last number */
+            char *p = buf + strlen (buf);
+            while (p > buf && (p[-1] < '0' || p[-1] > '9')) *--p = 0;
+            while (p > buf && p[-1] >= '0' && p[-1] <= '9') p--;
+            if (*p) res = atoi (p);
+        }
+        fclose (f);
+    }
+    if (res < 0 && ncpu > 1) res = ncpu - 1;
+    if (res >= ncpu) res = -1;
+    return res;
+}
+
+/** Prepare the process for realtime threads. Locks all current and
+  * future memory, so that page faults can't stall the MIDI threads,
+  * and picks the CPU they run on. Future mappings get locked as their
+  * pages are first touched, rather than read in whole when mapped, so
+  * mapping a large file stays cheap. Thread stacks get touched up front
+  * by thread_prefault(). The calling thread, which goes on to run the
+  * UI, is kept off the realtime CPU, along with every thread it starts
+  * that doesn't pick a CPU of its own. Call this before any threads are
+  * created. Without the privileges for it, everything still runs, just
+  * without the guarantees.
+  */
+void thread_setup_process (void) {
+    cpu_set_t set;
+    long n = sysconf (_SC_NPROCESSORS_ONLN);
+    RT.ncpu = (n > 0) ? (int) n : 1;
+    RT.rtcpu = thread_pick_rtcpu (RT.ncpu);
+    if (RT.rtcpu >= 0) {
+        CPU_ZERO (&set);
+        for (int i=0; i<RT.ncpu; ++i) if (i != RT.rtcpu) CPU_SET (i, &set);
+        pthread_setaffinity_np (pthread_self(), sizeof (set), &set);
+    }
+    bool onfault = false;
+    RT.locked = (mlockall (MCL_CURRENT) == 0);
+#ifdef MCL_ONFAULT
+    onfault = RT.locked && (mlockall (MCL_FUTURE | MCL_ONFAULT) == 0);
+#endif
+    /* Kernels before 4.4 can only lock future mappings in whole */
+    if (RT.locked && ! onfault) {
+        RT.locked = (mlockall (MCL_CURRENT | MCL_FUTURE) == 0);
+    }
+    fprintf (stderr, "memory %s, realtime cpu %i of %i\n",
+             RT.locked ? "locked" : "not locked", RT.rtcpu, RT.ncpu);
+}
+
+/** Touch the top of the stack, so its pages are mapped before any
+  * deadlines are at stake */
+static void thread_prefault (void) {
+    volatile char buf[THREAD_PREFAULT];
+    for (size_t i=0; i<THREAD_PREFAULT; i+=1024) buf[i] = 0;
+    (void) buf;
+}
+
+/** Apply the scheduling settings for a thread's role to the calling
+  * thread, and record what took effect. Realtime threads go on the
+  * realtime CPU, the others keep off it.
+  */
+static void thread_apply_role (thread *self) {
+    const threadconfig *cf = ROLES + self->role;
+    cpu_set_t set;
+    
+    thread_prefault();
+    
+    self->cpu = -1;
+    if (RT.rtcpu >= 0) {
+        CPU_ZERO (&set);
+        for (int i=0; i<RT.ncpu; ++i) {
+            if ((i == RT.rtcpu) == cf->isolate) CPU_SET (i, &set);
+        }
+        if (pthread_setaffinity_np (pthread_self(), sizeof (set), &set) == 0
+            && cf->isolate) self->cpu = RT.rtcpu;
+    }
+    
+    self->policy = SCHED_OTHER;
+    if (cf->policy != SCHED_OTHER) {
+        struct sched_param sp = { .sched_priority = cf->priority };
+        __atomic_add_fetch (&RT.wanted, 1, __ATOMIC_RELAXED);
+        if (pthread_setschedparam (pthread_self(), cf->policy, &sp) == 0) {
+            self->policy = cf->policy;
+            __atomic_add_fetch (&RT.granted, 1, __ATOMIC_RELAXED);
+        }
+    }
+    
+    if (self->policy != cf->policy) {
+        fprintf (stderr, "thread %s: no realtime priority\n", cf->name);
+    }
+    else if (self->policy == SCHED_FIFO) {
+        fprintf (stderr, "thread %s: SCHED_FIFO/%i cpu %i\n", cf->name,
+                 cf->priority, self->cpu);
+    }
+    else fprintf (stderr, "thread %s: SCHED_OTHER\n", cf->name);
+}
+
+/** Describe the realtime setup that took effect in a line of the LCD,
+  * like "RT 3/3 cpu3 lock": threads that got realtime priority out of
+  * those that asked for it, the realtime CPU, and whether memory is
+  * locked.
+  */
+void thread_rt_status (char *into, size_t sz) {
+    char cpu[16] = "any";
+    if (RT.rtcpu >= 0) snprintf (cpu, sizeof (cpu), "cpu%i", RT.rtcpu);
+    snprintf (into, sz, "RT %i/%i %-4s %s",
+              __atomic_load_n (&RT.granted, __ATOMIC_RELAXED),
+              __atomic_load_n (&RT.wanted, __ATOMIC_RELAXED),
+              cpu, RT.locked ? "lock" : "nolk");
+}
 
 /** Post-cancel/post-exit cleanup routing. Will call the thread-defined
   * cancel routine if there is any.
@@ -15,6 +202,7 @@ void thread_cleanup (void *dt) {
 void *thread_spawn (void *dt) {
     thread *self = (thread *) dt;
     self->isrunning = 1;
+    thread_apply_role (self);
     pthread_cleanup_push (thread_cleanup, self);
     self->run (self);
     pthread_cleanup_pop(0);
@@ -24,9 +212,9 @@ void *thread_spawn (void *dt) {
 }
 
 /** Allocate and spawn a thread */
-thread *thread_create (run_f run, cancel_f cancel) {
+thread *thread_create (threadrole role, run_f run, cancel_f cancel) {
     thread *self = (thread *) malloc (sizeof (thread));
-    thread_init (self, run, cancel);
+    thread_init (self, role, run, cancel);
     return self;
 }
 
@@ -37,11 +225,17 @@ conditional *conditional_create (void) {
     return c;
 }
 
-/** Initialize a conditional */
+/** Initialize a conditional. Timed waits are measured against
+  * CLOCK_MONOTONIC, so wall clock adjustments don't move deadlines.
+  */
 void conditional_init (conditional *self) {
+    pthread_condattr_t cattr;
     pthread_mutexattr_init (&self->mattr);
     pthread_mutex_init (&self->mutex, &self->mattr);
-    pthread_cond_init (&self->cond, NULL);
+    pthread_condattr_init (&cattr);
+    pthread_condattr_setclock (&cattr, CLOCK_MONOTONIC);
+    pthread_cond_init (&self->cond, &cattr);
+    pthread_condattr_destroy (&cattr);
     self->queue = 0;
 }
 
@@ -66,6 +260,27 @@ void conditional_wait (conditional *self) {
     pthread_mutex_unlock (&self->mutex);
 }
 
+/** Wait for a signal (or pick a backlogged one off the queue), but
+  * give up when an absolute CLOCK_MONOTONIC deadline passes.
+  * \param until The deadline.
+  * \return 1 if a signal was picked up, 0 if the deadline passed.
+  */
+int conditional_wait_until (conditional *self, const struct timespec *until) {
+    int res = 0;
+    pthread_mutex_lock (&self->mutex);
+    while (! self->queue) {
+        res = pthread_cond_timedwait (&self->cond, &self->mutex, until);
+        if (res == ETIMEDOUT) break;
+    }
+    if (self->queue) {
+        self->queue--;
+        pthread_mutex_unlock (&self->mutex);
+        return 1;
+    }
+    pthread_mutex_unlock (&self->mutex);
+    return 0;
+}
+
 /** Wait for a new signal (queued doesn't count) */
 void conditional_wait_fresh (conditional *self) {
     pthread_mutex_lock (&self->mutex);
@@ -88,13 +303,20 @@ void conditional_free (conditional *c) {
     free (c);
 }
 
-/** Initialize a thread structure and spawn it */
-void thread_init (thread *self, run_f run, cancel_f cancel) {
+/** Initialize a thread structure and spawn it. The thread sets up its
+  * own scheduling according to its role once it runs.
+  */
+void thread_init (thread *self, threadrole role, run_f run,
+                  cancel_f cancel) {
     self->run = run;
     self->cancel = cancel;
     self->isrunning = 0;
     self->cshutdown = conditional_create();
+    self->role = role;
+    self->policy = SCHED_OTHER;
+    self->cpu = -1;
     pthread_attr_init (&self->tattr);
+    pthread_attr_setstacksize (&self->tattr, THREAD_STACK);
     pthread_create (&self->thread, &self->tattr, thread_spawn, self);
 }
 
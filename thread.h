@@ -2,15 +2,36 @@
 #define _THREAD_H 1
 
 #include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
+#include <time.h>
 
 /* =============================== TYPES =============================== */
 
+/** getclock() units */
+#define CLOCK_USEC 1000ULL
+#define CLOCK_MSEC 1000000ULL
+#define CLOCK_SEC 1000000000ULL
+
+/** What a thread is for, which decides how it gets scheduled */
+typedef enum {
+    THREAD_UI = 0, /**< User interface, normal priority */
+    THREAD_MIDI_IN, /**< MIDI receive loop */
+    THREAD_ENGINE, /**< Sequencer engine */
+    THREAD_MIDI_OUT, /**< MIDI output writer */
+    THREAD_IO, /**< Background file writes */
+    THREAD_ROLES
+} threadrole;
+
 struct thread_s; /* forward declaration */
 
 typedef void (*run_f)(struct thread_s *);
 typedef void (*cancel_f)(struct thread_s *);
 
+/** A replacement time source for getclock(), in ns */
+typedef uint64_t (*clock_f)(void);
+
 typedef struct conditional_s {
     pthread_mutexattr_t  mattr; /**< Pthread overhead for the conditional */
     pthread_mutex_t      mutex; /**< Pthread overhead for the conditional */
@@ -26,22 +47,30 @@ typedef struct thread_s {
     pthread_t        thread; /**< Pthread storage */
     int              isrunning; /**< 1 if thread is spawned */
     conditional     *cshutdown; /**< Conditional to poll for thread shutdown */
+    threadrole       role; /**< What the thread is for */
+    int              policy; /**< Scheduling policy that took effect */
+    int              cpu; /**< CPU the thread is pinned to, or -1 */
 } thread;
 
 /* ============================= FUNCTIONS ============================= */
 
 int          musleep (uint64_t);
+uint64_t     getclock (void);
+void         thread_set_clock (clock_f);
 void        *thread_spawn (void *);
-void         thread_init (thread *, run_f, cancel_f);
-thread      *thread_create (run_f, cancel_f);
+void         thread_init (thread *, threadrole, run_f, cancel_f);
+thread      *thread_create (threadrole, run_f, cancel_f);
 void         thread_free (thread *);
 void         thread_cancel (thread *);
+void         thread_setup_process (void);
+void         thread_rt_status (char *, size_t);
 
 conditional *conditional_create (void);
 void         conditional_free (conditional *);
 void         conditional_init (conditional *);
 void         conditional_signal (conditional *);
 void         conditional_wait (conditional *);
+int          conditional_wait_until (conditional *, const struct timespec *);
 void         conditional_wait_fresh (conditional *);
 
 #endif
@@ -9,6 +9,8 @@
 #include "presets.h"
 #include "btevent.h"
 #include "midi.h"
+#include "tempo.h"
+#include "store.h"
 
 /** Usable character set for preset names */
 const char *CSET = " ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz"
@@ -17,7 +19,8 @@ const char *CSET = " ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz"
 static void *last_edit_page = ui_edit_tr_notecount;
 
 /** Main runner. Jumpst into ui_performance(), then follows the trail left
-  * by returns.
+  * by returns. Every page that edits the preset returns here, so any
+  * change it made gets published to the MIDI engine on the way out.
   */
 void ui_main (void) {
     uifunc call = ui_splash;
@@ -25,6 +28,7 @@ void ui_main (void) {
     lcd_init();
     while (1) {
         ncall = call();
+        context_publish_preset();
         if (ncall) call = ncall;
     }
 }
@@ -134,8 +138,10 @@ void *ui_generic_choice_menu (int curval,
             case BTMASK_STK_CLICK:
                 button_manager_add_event (e->buttons, 0);
                 *writeto = ui_select (curval, x, 1, len, count, names, values);
+                /* Back through ui_main(), which publishes the change */
                 if (cb) return cb();
-                break;
+                button_event_free (e);
+                return NULL;
                 
             case BTMASK_LEFT:
             case BTMASK_STK_LEFT:
@@ -166,12 +172,63 @@ void *ui_generic_choice_menu (int curval,
 
 void *ui_save_global (void) {
     context_write_global();
+    midi_apply_settings();
     return ui_edit_main;
 }
 
-void *ui_edit_global_sync (void) {
+void *ui_edit_global_outlink (void) {
+    lcd_home();
+    lcd_printf ("System Setup       \n");
+    return ui_generic_choice_menu ((int) CTX.out_link,
+                                   "Out Link:",
+                                   2,
+                                   (int*) &CTX.out_link,
+                                   (const char *[]){"USB","DIN"},
+                                   (int []){LINK_USB,LINK_DIN},
+                                   ui_edit_global_lookahead,
+                                   ui_edit_global_presetswitch,
+                                   ui_save_global,
+                                   NULL);
+}
+
+void *ui_edit_global_presetswitch (void) {
+    lcd_home();
+    lcd_printf ("System Setup       \n");
+    return ui_generic_choice_menu ((int) CTX.preset_switch,
+                                   "Preset Sw:",
+                                   3,
+                                   (int*) &CTX.preset_switch,
+                                   (const char *[]){"Bar","Beat","Now"},
+                                   (int []){SWITCH_BAR,SWITCH_BEAT,SWITCH_NOW},
+                                   ui_edit_global_outlink,
+                                   NULL,
+                                   ui_save_global,
+                                   NULL);
+}
+
+void *ui_edit_global_lookahead (void) {
     lcd_home();
     lcd_printf ("System Setup       \n");
+    return ui_generic_choice_menu (CTX.lookahead,
+                                   "Lookahead:",
+                                   5,
+                                   &CTX.lookahead,
+                                   (const char *[]){
+                                    "Off","5ms","10ms","20ms","40ms"
+                                   },
+                                   (int []){0,5,10,20,40},
+                                   ui_edit_global_clockout,
+                                   ui_edit_global_outlink,
+                                   ui_save_global,
+                                   NULL);
+}
+
+void *ui_edit_global_sync (void) {
+    int jitter = 0;
+    lcd_home();
+    if (! CTX.ext_sync) lcd_printf ("System Setup       \n");
+    else if (! midi_sync_status (&jitter)) lcd_printf ("Sync no lock    \n");
+    else lcd_printf ("Sync lock %2i.%ims\n", jitter/1000, (jitter/100)%10);
     return ui_generic_choice_menu ((int) CTX.ext_sync,
                                    "Ext Sync:",
                                    2,
@@ -179,7 +236,22 @@ void *ui_edit_global_sync (void) {
                                    (const char *[]){"Off","On"},
                                    (int []){0,1},
                                    ui_edit_global_channel,
-                                   NULL,
+                                   ui_edit_global_clockout,
+                                   ui_save_global,
+                                   NULL);
+}
+
+void *ui_edit_global_clockout (void) {
+    lcd_home();
+    lcd_printf ("System Setup       \n");
+    return ui_generic_choice_menu ((int) CTX.clock_out,
+                                   "Clock Out:",
+                                   2,
+                                   (int*) &CTX.clock_out,
+                                   (const char *[]){"Off","On"},
+                                   (int []){0,1},
+                                   ui_edit_global_sync,
+                                   ui_edit_global_lookahead,
                                    ui_save_global,
                                    NULL);
 }
@@ -198,27 +270,48 @@ void *ui_edit_global_channel (void) {
                                    (int []){
                                      0,1,2,3,4,5,6,7,8,9,10,11,12,13,14,15
                                    },
-                                   ui_edit_global_triggertype,
+                                   ui_edit_global_inchannel,
                                    ui_edit_global_sync,
                                    ui_save_global,
                                    NULL);
 }
 
+void *ui_edit_global_inchannel (void) {
+    lcd_home();
+    lcd_printf ("System Setup       \n");
+    return ui_generic_choice_menu (CTX.in_channel[0],
+                                   "In Channel:",
+                                   17,
+                                   &CTX.in_channel[0],
+                                   (const char *[]){
+                                    "Omni","1","2","3","4","5","6","7","8",
+                                    "9","10","11","12","13","14","15","16"
+                                   },
+                                   (int []){
+                                     0,1,2,3,4,5,6,7,8,9,10,11,12,13,14,15,16
+                                   },
+                                   ui_edit_global_triggertype,
+                                   ui_edit_global_channel,
+                                   ui_save_global,
+                                   NULL);
+}
+
 
 void *ui_edit_global_triggertype (void) {
         lcd_home();
         lcd_printf ("System Setup       \n");
-    return ui_generic_choice_menu ((int) CTX.trigger_type,
+    return ui_generic_choice_menu ((int) CTX.trigger_type[0],
                                    "Type:",
-                                   6,
-                                   (int*) &CTX.trigger_type,
+                                   7,
+                                   (int*) &CTX.trigger_type[0],
                                    (const char *[]){
                                         "Roland TR8",
                                         "Laserharp8",
                                         "Laserharp9",
                                         "Laserhar10",
                                         "Chromatic",
-                                        "Pedals 7"
+                                        "Pedals 7",
+                                        "Custom"
                                    },
                                    (int []){
                                         TYPE_ROLAND_TR8,
@@ -226,10 +319,11 @@ void *ui_edit_global_triggertype (void) {
                                         TYPE_LASERHARP_9,
                                         TYPE_LASERHARP_10,
                                         TYPE_CHROMATIC,
-                                        TYPE_PEDALS_7
+                                        TYPE_PEDALS_7,
+                                        TYPE_CUSTOM
                                    },
                                    ui_edit_global,
-                                   ui_edit_global_channel,
+                                   ui_edit_global_inchannel,
                                    ui_save_global,
                                    NULL);
 }
@@ -249,7 +343,8 @@ void* ui_edit_global (void) {
             
             case BTMASK_STK_LEFT:
             case BTMASK_LEFT:
-                break;
+                button_event_free (e);
+                return ui_edit_global_realtime;
             
             case BTMASK_STK_CLICK:
             case BTMASK_PLUS:
@@ -264,6 +359,29 @@ void* ui_edit_global (void) {
     }
 }
 
+/** Shows which realtime scheduling settings took effect */
+void *ui_edit_global_realtime (void) {
+    char status[32];
+    while (1) {
+        thread_rt_status (status, sizeof (status));
+        lcd_home();
+        lcd_printf ("System Setup       \n%-16s", status);
+        
+        button_event *e = button_manager_wait_event (0);
+        switch (e->buttons) {
+            case BTMASK_STK_RIGHT:
+            case BTMASK_RIGHT:
+                button_event_free (e);
+                return ui_edit_global;
+            
+            case BTMASK_SHIFT:
+                button_event_free (e);
+                return ui_save_global;
+        }
+        button_event_free (e);
+    }
+}
+
 /** Note names */
 const char *TB_NOTES[12] = {"C-","C#","D-","D#","E-","F-",
                             "F#","G-","G#","A-","A#","B-"};
@@ -279,12 +397,77 @@ void ui_write_note (char notenr) {
     }
 }
 
-void *ui_edit_prevfrom_tr_copy (void) {
+/** Recompile the step table of the edited trigger after a change */
+void *ui_handle_tr_change (void) {
+    context_compile_trigger (CTX.trigger_nr);
+    return NULL;
+}
+
+void *ui_edit_prevfrom_tr_port (void) {
     triggerpreset *tpreset = CTX.preset.triggers + CTX.trigger_nr;
     if (tpreset->send == SEND_SEQUENCE) return ui_edit_tr_seq_move;
     else return ui_edit_tr_notes_mode;
 }
 
+/** Scratch value for the output menus, the preset fields are bytes */
+static int ui_edit_tr_outval;
+
+/** Store the chosen output port of the edited trigger */
+void *ui_handle_tr_port (void) {
+    CTX.preset.triggers[CTX.trigger_nr].port = ui_edit_tr_outval;
+    return NULL;
+}
+
+/** Menu for the output port of a trigger */
+void *ui_edit_tr_port (void) {
+    triggerpreset *tpreset = CTX.preset.triggers + CTX.trigger_nr;
+    ui_edit_tr_outval = tpreset->port;
+    lcd_home();
+    lcd_printf ("Trigger %i       \n", CTX.trigger_nr+1);
+    return ui_generic_choice_menu (ui_edit_tr_outval,
+                                   "Out Port:",
+                                   OUTPUT_PORTS,
+                                   &ui_edit_tr_outval,
+                                   (const char *[]){"1","2","3","4"},
+                                   (int []){0,1,2,3},
+                                   ui_edit_prevfrom_tr_port,
+                                   ui_edit_tr_channel,
+                                   ui_edit_trig,
+                                   ui_handle_tr_port);
+}
+
+/** Store the chosen output channel of the edited trigger */
+void *ui_handle_tr_channel (void) {
+    CTX.preset.triggers[CTX.trigger_nr].channel = ui_edit_tr_outval;
+    return NULL;
+}
+
+/** Menu for the output channel of a trigger. Global follows the send
+  * channel of the system setup. */
+void *ui_edit_tr_channel (void) {
+    triggerpreset *tpreset = CTX.preset.triggers + CTX.trigger_nr;
+    ui_edit_tr_outval = tpreset->channel;
+    lcd_home();
+    lcd_printf ("Trigger %i       \n", CTX.trigger_nr+1);
+    return ui_generic_choice_menu (ui_edit_tr_outval,
+                                   "Out Chan:",
+                                   17,
+                                   &ui_edit_tr_outval,
+                                   (const char *[]){
+                                    "Global","1","2","3","4","5","6","7",
+                                    "8","9","10","11","12","13","14","15",
+                                    "16"
+                                   },
+                                   (int []){
+                                     0,1,2,3,4,5,6,7,8,9,10,11,12,13,14,
+                                     15,16
+                                   },
+                                   ui_edit_tr_port,
+                                   ui_edit_tr_copy,
+                                   ui_edit_trig,
+                                   ui_handle_tr_channel);
+}
+
 static int ui_edit_tr_copyfrom = -1;
 
 void *ui_handle_tr_copy (void) {
@@ -293,6 +476,7 @@ void *ui_handle_tr_copy (void) {
     if (copyfrom >= 0) {
         memcpy (tpreset, CTX.preset.triggers + copyfrom,
                 sizeof (triggerpreset));
+        context_compile_trigger (CTX.trigger_nr);
         lcd_setpos (0,1);
         lcd_printf ("Trigger copied..");
         sleep (1);
@@ -317,7 +501,7 @@ void *ui_edit_tr_copy (void) {
                                    (int []){
                                         -1,0,1,2,3,4,5,6,7,8,9,10,11,12
                                    },
-                                   ui_edit_prevfrom_tr_copy,
+                                   ui_edit_tr_channel,
                                    NULL,
                                    ui_edit_trig,
                                    ui_handle_tr_copy);
@@ -353,9 +537,9 @@ void *ui_edit_tr_seq_move (void) {
                                         MOVE_LOOP_RANDOM
                                    },
                                    ui_edit_tr_seq_range,
-                                   ui_edit_tr_copy,
+                                   ui_edit_tr_port,
                                    ui_edit_trig,
-                                   NULL);
+                                   ui_handle_tr_change);
 }
 
 /** Menu for the sequence range parameter */
@@ -382,7 +566,7 @@ void *ui_edit_tr_seq_range (void) {
                                    ui_edit_tr_seq_gate,
                                    ui_edit_tr_seq_move,
                                    ui_edit_trig,
-                                   NULL);
+                                   ui_handle_tr_change);
 }
 
 /** Menu for the sequence gate parameter */
@@ -417,7 +601,7 @@ void *ui_edit_tr_seq_gate (void) {
                                    ui_edit_tr_seq_length,
                                    ui_edit_tr_seq_range,
                                    ui_edit_trig,
-                                   NULL);
+                                   ui_handle_tr_change);
 }
 
 /** Menu for the sequence note length parameter */
@@ -446,7 +630,7 @@ void *ui_edit_tr_seq_length (void) {
                                    ui_edit_tr_sendconfig,
                                    ui_edit_tr_seq_gate,
                                    ui_edit_trig,
-                                   NULL);
+                                   ui_handle_tr_change);
 }
 
 /** Menu for the note trigger mode parameter */
@@ -477,7 +661,7 @@ void *ui_edit_tr_notes_mode (void) {
                                         NMODE_LEGATO
                                    },
                                    ui_edit_tr_sendconfig,
-                                   ui_edit_tr_copy,
+                                   ui_edit_tr_port,
                                    ui_edit_trig,
                                    NULL);
 }
@@ -565,7 +749,7 @@ void *ui_edit_velocities (void) {
                 break;
         }
         button_event_free (e);
-        
+        context_compile_trigger (CTX.trigger_nr);
     }
 }
 
@@ -646,7 +830,7 @@ void *ui_edit_tr_velocity_mode (void) {
                                    ui_edit_tr_notes,
                                    ui_edit_nextfrom_tr_velocity_mode,
                                    ui_edit_trig,
-                                   NULL);
+                                   ui_handle_tr_change);
 }
 
 /** The chord/sequence note editor. Edits as many notes as configured
@@ -712,7 +896,7 @@ void *ui_edit_notes (void) {
                 break;
         }
         button_event_free (e);
-        
+        context_compile_trigger (CTX.trigger_nr);
     }
 }
 
@@ -783,7 +967,7 @@ void *ui_edit_tr_notecount (void) {
                                    NULL,
                                    ui_edit_tr_notes,
                                    ui_edit_trig,
-                                   NULL);
+                                   ui_handle_tr_change);
 
     /* If the sequence length increased, copy note values from the
      * formerly last note of the sequence. */
@@ -795,6 +979,7 @@ void *ui_edit_tr_notecount (void) {
             }
             ++x;
         }
+        context_compile_trigger (CTX.trigger_nr);
     } 
     
     return res;
@@ -896,13 +1081,121 @@ void *ui_edit_name (void) {
     }
 }
 
+/** Preset sequencer mode */
+void *ui_edit_seqmode (void) {
+    lcd_home();
+    lcd_printf ("%02i|%-13s\n", CTX.preset_nr, CTX.preset.name);
+    return ui_generic_choice_menu ((int) CTX.preset.seqmode,
+                                   "Seq Mode:",
+                                   2,
+                                   (int*) &CTX.preset.seqmode,
+                                   (const char *[]){"One","Layer"},
+                                   (int []){SEQMODE_SINGLE,SEQMODE_LAYERED},
+                                   NULL,
+                                   ui_edit_tempo,
+                                   ui_edit_main,
+                                   NULL);
+}
+
+/** Edit the preset tempo, down to a hundredth of a BPM. Plus and minus
+  * step by a whole BPM, the stick by a hundredth, and by a tenth with
+  * shift held.
+  */
+void *ui_edit_tempo (void) {
+    while (1) {
+        int centibpm = CTX.preset.tempo * 100 + CTX.preset.tempo_frac;
+        lcd_home();
+        lcd_printf ("%02i|%-13s\n", CTX.preset_nr, CTX.preset.name);
+        lcd_printf ("Tempo: %3i.%02i   ", centibpm / 100, centibpm % 100);
+        
+        int delta = 0;
+        button_event *e = button_manager_wait_event (0);
+        switch (e->buttons) {
+            case BTMASK_LEFT:
+                button_event_free (e);
+                return ui_edit_seqmode;
+            
+            case BTMASK_PLUS: delta = 100; break;
+            case BTMASK_MINUS: delta = -100; break;
+            case BTMASK_STK_RIGHT: delta = 1; break;
+            case BTMASK_STK_LEFT: delta = -1; break;
+            case BTMASK_SHIFT | BTMASK_STK_RIGHT: delta = 10; break;
+            case BTMASK_SHIFT | BTMASK_STK_LEFT: delta = -10; break;
+            
+            case BTMASK_SHIFT:
+                button_event_free (e);
+                return ui_edit_main;
+        }
+        button_event_free (e);
+        
+        if (! delta) continue;
+        centibpm += delta;
+        if (centibpm < TEMPO_MIN) centibpm = TEMPO_MIN;
+        if (centibpm > TEMPO_MAX) centibpm = TEMPO_MAX;
+        CTX.preset.tempo = centibpm / 100;
+        CTX.preset.tempo_frac = centibpm % 100;
+        context_publish_preset();
+        midi_apply_tempo();
+    }
+}
+
+/** Browse the preset library, showing the names of presets without
+  * loading them. The stick moves through the presets of a bank, plus
+  * and minus move through the banks, and a click loads the preset
+  * shown.
+  */
+void *ui_browse (void) {
+    int bank = CTX.bank_nr;
+    int nr = CTX.preset_nr;
+    while (1) {
+        lcd_home();
+        lcd_printf ("%02i|%-13s\n", nr, context_preset_name (bank, nr));
+        lcd_printf ("  |Bank %02i      ", bank);
+        
+        button_event *e = button_manager_wait_event (0);
+        switch (e->buttons) {
+            case BTMASK_STK_RIGHT:
+            case BTMASK_RIGHT:
+                if (nr < STORE_BANKPRESETS) nr++;
+                break;
+            
+            case BTMASK_STK_LEFT:
+            case BTMASK_LEFT:
+                if (nr > 1) nr--;
+                break;
+            
+            case BTMASK_PLUS:
+                if (bank < STORE_BANKS) bank++;
+                break;
+            
+            case BTMASK_MINUS:
+                if (bank > 1) bank--;
+                break;
+            
+            case BTMASK_STK_CLICK:
+                button_event_free (e);
+                CTX.bank_nr = bank;
+                context_load_preset (nr);
+                midi_apply_preset();
+                return ui_performance;
+            
+            case BTMASK_SHIFT:
+                button_event_free (e);
+                return ui_edit_main;
+        }
+        button_event_free (e);
+    }
+}
+
 static uint8_t main_menu_pos = 0;
 
 /** Edit main menu */
 void *ui_edit_main (void) {
     uint8_t choice = main_menu_pos;
-    const char *ch_name[3] = {"Edit Name","Edit Triggers","System Setup"};
-    uifunc ch_jump[3] = {ui_edit_name, ui_edit_trig, ui_edit_global};
+    const char *ch_name[5] = {"Edit Name","Edit Triggers","Sequencers",
+                              "System Setup","Browse Banks"};
+    uifunc ch_jump[5] = {ui_edit_name, ui_edit_trig, ui_edit_seqmode,
+                         ui_edit_global, ui_browse};
     while (1) {
         lcd_home();
         lcd_printf ("%02i|%-13s\n  |%-13s",   
@@ -915,14 +1208,14 @@ void *ui_edit_main (void) {
             case BTMASK_STK_RIGHT:
             case BTMASK_RIGHT:
                 choice = choice+1;
-                if (choice>2) choice = 0;
+                if (choice>4) choice = 0;
                 main_menu_pos = choice;
                 break;
             
             case BTMASK_STK_LEFT:
             case BTMASK_LEFT:
                 if (choice) choice = choice-1;
-                else choice = 2;
+                else choice = 4;
                 main_menu_pos = choice;
                 break;
             
@@ -953,8 +1246,11 @@ void *ui_performance (void) {
     int tempo = CTX.ext_sync ? CTX.ext_tempo : CTX.preset.tempo;
     char s_tempo[8];
     sprintf (s_tempo, "%3i", tempo);
+    if (! CTX.ext_sync && CTX.preset.tempo_frac) {
+        sprintf (s_tempo, "%3i.%02i", tempo, CTX.preset.tempo_frac);
+    }
     if (! tempo) strcpy (s_tempo, "EXT");
-    lcd_printf ("%02i|%-13s\n%c%c|\001 %s     %s%c%i",   
+    lcd_printf ("%02i|%-13s\n%c%c|\001 %-6s  %s%c%i",   
                 CTX.preset_nr,
                 CTX.preset.name,
                 light_midi_in ? '\005' : ' ',
@@ -966,6 +1262,7 @@ void *ui_performance (void) {
     
     button_event *e = button_manager_wait_event (1);
     switch (e->buttons) {
+        case 0: midi_check_ports(); break;
         case BTMASK_MDIN_ON: light_midi_in = true; break;
         case BTMASK_MDIN_OFF: light_midi_in = false; break;
         case BTMASK_MDOUT_ON: light_midi_out = true; break;
@@ -973,40 +1270,47 @@ void *ui_performance (void) {
         case BTMASK_SHIFT | BTMASK_RIGHT:
             if (CTX.transpose < 25) {
                 CTX.transpose++;
+                midi_apply_transpose();
             }
             break;
 
         case BTMASK_SHIFT | BTMASK_LEFT:
             if (CTX.transpose > -25) {
                 CTX.transpose--;
+                midi_apply_transpose();
             }
             break;
         
         case BTMASK_STK_RIGHT:
         case BTMASK_RIGHT:
             if (CTX.preset_nr < 99) {
-                midi_stop_sequencer();
                 context_load_preset (CTX.preset_nr + 1);
+                midi_apply_preset();
             }
             break;
         
         case BTMASK_STK_LEFT:
         case BTMASK_LEFT:
             if (CTX.preset_nr > 1) {
-                midi_stop_sequencer();
                 context_load_preset (CTX.preset_nr - 1);
+                midi_apply_preset();
             }
             break;
             
         case BTMASK_PLUS:
-            if (CTX.preset.tempo < 257) {
+            if ((CTX.preset.tempo+1)*100 + CTX.preset.tempo_frac <=
+                TEMPO_MAX) {
                 if (! CTX.ext_sync) CTX.preset.tempo++;
+                context_publish_preset();
+                midi_apply_tempo();
             }
             break;
         
         case BTMASK_MINUS:
-            if (CTX.preset.tempo > 41) {
+            if (CTX.preset.tempo > TEMPO_MIN/100) {
                 if (! CTX.ext_sync) CTX.preset.tempo--;
+                context_publish_preset();
+                midi_apply_tempo();
             }
             break;
         
@@ -1019,6 +1323,14 @@ void *ui_performance (void) {
         case BTMASK_SHIFT | BTMASK_PLUS:
             midi_panic();
             break;
+        
+        case BTMASK_SHIFT | BTMASK_STK_LEFT:
+            midi_transport_stop();
+            break;
+        
+        case BTMASK_SHIFT | BTMASK_STK_RIGHT:
+            midi_transport_continue();
+            break;
     }
     
     button_event_free (e);
@@ -16,15 +16,27 @@ void    *ui_generic_choice_menu (int cv, const char *pr, int cnt,
                                  int *writeto, const char *n[], int v[],
                                  void *lr, void *rr, void *ur, uifunc);
 void     ui_write_note (char);
+void    *ui_edit_global_outlink (void);
+void    *ui_edit_global_presetswitch (void);
+void    *ui_edit_global_lookahead (void);
+void    *ui_edit_global_clockout (void);
+void    *ui_edit_global_realtime (void);
 void    *ui_edit_global_sync (void);
 void    *ui_edit_global_channel (void);
+void    *ui_edit_global_inchannel (void);
 void    *ui_edit_global_triggertype (void);
 void    *ui_edit_global (void);
+void    *ui_edit_seqmode (void);
+void    *ui_edit_tempo (void);
+void    *ui_handle_tr_change (void);
 void    *ui_edit_tr_seq_move (void);
 void    *ui_edit_tr_seq_range (void);
 void    *ui_edit_tr_seq_gate (void);
 void    *ui_edit_tr_seq_length (void);
 void    *ui_edit_tr_notes_mode (void);
+void    *ui_edit_tr_port (void);
+void    *ui_edit_tr_channel (void);
+void    *ui_edit_tr_copy (void);
 void    *ui_edit_prevfrom_tr_sendconfig (void);
 void    *ui_edit_nextfrom_tr_sendconfig (void);
 void    *ui_edit_tr_sendconfig (void);
@@ -37,6 +49,7 @@ void    *ui_edit_tr_notes (void);
 void    *ui_edit_tr_notecount (void);
 void    *ui_edit_trig (void);
 void    *ui_edit_name (void);
+void    *ui_browse (void);
 void    *ui_edit_main (void);
 void    *ui_performance (void);
 void    *ui_waitmidi (void);
@@ -0,0 +1,99 @@
+#include "voices.h"
+#include <string.h>
+
+/** Initialize a tracker with nothing sounding */
+void voices_init (voices *self) {
+    memset (self, 0, sizeof (voices));
+}
+
+/** Have an owner take a voice.
+  * \param owner The owner (0-15).
+  * \param id The voice.
+  * \return true if the voice wasn't sounding before.
+  */
+bool voices_on (voices *self, int owner, uint16_t id) {
+    int line = VOICE_LINE (id);
+    int note = VOICE_NOTE (id);
+    uint64_t bit = 1ULL << (note & 63);
+    bool res = (self->owners[line][note] == 0);
+    self->owners[line][note] |= (1 << owner);
+    self->on[line][note >> 6] |= bit;
+    self->held[owner][line][note >> 6] |= bit;
+    return res;
+}
+
+/** Have an owner let go of a voice.
+  * \param owner The owner (0-15).
+  * \param id The voice.
+  * \return true if the owner held the voice, and was the last one to.
+  */
+bool voices_off (voices *self, int owner, uint16_t id) {
+    int line = VOICE_LINE (id);
+    int note = VOICE_NOTE (id);
+    uint64_t bit = 1ULL << (note & 63);
+    if (! (self->owners[line][note] & (1 << owner))) return false;
+    self->held[owner][line][note >> 6] &= ~bit;
+    self->owners[line][note] &= ~(1 << owner);
+    if (self->owners[line][note]) return false;
+    self->on[line][note >> 6] &= ~bit;
+    return true;
+}
+
+/** Returns true if any owner holds a voice */
+bool voices_sounding (const voices *self, uint16_t id) {
+    return self->owners[VOICE_LINE (id)][VOICE_NOTE (id)] != 0;
+}
+
+/** Returns true if an owner holds a voice */
+bool voices_held (const voices *self, int owner, uint16_t id) {
+    return (self->owners[VOICE_LINE (id)][VOICE_NOTE (id)] &
+            (1 << owner)) != 0;
+}
+
+/** Let go of everything an owner holds.
+  * \param owner The owner (0-15).
+  * \param into Receives the voices that stopped sounding, room for
+  *             VOICES_MAX.
+  * \return The number of voices that stopped sounding.
+  */
+int voices_release (voices *self, int owner, uint16_t *into) {
+    int count = 0;
+    for (int line=0; line<VOICES_LINES; ++line) {
+        for (int w=0; w<2; ++w) {
+            uint64_t bits = self->held[owner][line][w];
+            self->held[owner][line][w] = 0;
+            while (bits) {
+                int note = (w << 6) | __builtin_ctzll (bits);
+                bits &= bits - 1;
+                self->owners[line][note] &= ~(1 << owner);
+                if (self->owners[line][note]) continue;
+                self->on[line][w] &= ~(1ULL << (note & 63));
+                into[count++] = (uint16_t) ((line << 7) | note);
+            }
+        }
+    }
+    return count;
+}
+
+/** Let go of everything.
+  * \param into Receives the voices that were sounding, room for
+  *             VOICES_MAX.
+  * \return The number of voices that were sounding.
+  */
+int voices_clear (voices *self, uint16_t *into) {
+    int count = 0;
+    for (int line=0; line<VOICES_LINES; ++line) {
+        for (int w=0; w<2; ++w) {
+            uint64_t bits = self->on[line][w];
+            while (bits) {
+                int note = (w << 6) | __builtin_ctzll (bits);
+                bits &= bits - 1;
+                self->owners[line][note] = 0;
+                into[count++] = (uint16_t) ((line << 7) | note);
+            }
+            self->on[line][w] = 0;
+        }
+    }
+    memset (self->held, 0, sizeof (self->held));
+    return count;
+}
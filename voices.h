@@ -0,0 +1,51 @@
+#ifndef _VOICES_H
+#define _VOICES_H 1
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* =============================== TYPES =============================== */
+
+/** Number of owners a voice can have. Owners are the triggers. */
+#define VOICES_OWNERS 16
+
+/** Number of output ports, as OUTPUT_PORTS */
+#define VOICES_PORTS 4
+
+/** Number of channels over all ports */
+#define VOICES_LINES (VOICES_PORTS * 16)
+
+/** Number of distinct voices, one per port, channel and note */
+#define VOICES_MAX (VOICES_LINES * 128)
+
+/** Identifies a voice by its output port, channel (0-15) and note */
+#define VOICE_ID(port,chan,note) \
+    ((uint16_t) (((port) << 11) | ((chan) << 7) | (note)))
+#define VOICE_PORT(id) ((id) >> 11)
+#define VOICE_CHANNEL(id) (((id) >> 7) & 15)
+#define VOICE_NOTE(id) ((id) & 0x7f)
+#define VOICE_LINE(id) ((id) >> 7)
+
+/** Tracks which owners hold each sounding note of the output. A note
+  * keeps sounding as long as any owner holds it. Notes are also kept in
+  * bitsets per line (a channel of a port), and per owner and line, so
+  * releasing everything an owner holds, or everything that sounds, goes
+  * a word at a time.
+  */
+typedef struct voices_s {
+    uint16_t         owners[VOICES_LINES][128]; /**< Owner bits per note */
+    uint64_t         on[VOICES_LINES][2]; /**< Sounding notes per line */
+    uint64_t         held[VOICES_OWNERS][VOICES_LINES][2]; /**< Per owner */
+} voices;
+
+/* ============================= FUNCTIONS ============================= */
+
+void         voices_init (voices *);
+bool         voices_on (voices *, int, uint16_t);
+bool         voices_off (voices *, int, uint16_t);
+bool         voices_sounding (const voices *, uint16_t);
+bool         voices_held (const voices *, int, uint16_t);
+int          voices_release (voices *, int, uint16_t *);
+int          voices_clear (voices *, uint16_t *);
+
+#endif